@@ -0,0 +1,61 @@
+# Profile-guided release build, run in script mode by the 'pgo' target.
+#
+#   1. A plain Release build, kept for comparison.
+#   2. An instrumented build that runs tools/pgo/train.sh.
+#   3. A rebuild of the same tree with the recorded profile and LTO. GCC
+#      names its profile files after the object paths, so the instrumented
+#      and optimised builds must share a build directory.
+#   4. tools/pgo/report.sh compares both binaries and writes report.md.
+
+foreach(var SOURCE_DIR BINARY_DIR GENERATOR CXX_COMPILER CXX_COMPILER_ID DEFAULT_IMAGE_PATH)
+  if(NOT DEFINED ${var})
+    message(FATAL_ERROR "PgoBuild.cmake requires -D${var}=...")
+  endif()
+endforeach()
+
+set(PLAIN_DIR ${BINARY_DIR}/plain)
+set(OPTIMIZED_DIR ${BINARY_DIR}/optimized)
+set(PROFILE_DIR ${BINARY_DIR}/profile)
+set(COMMON_ARGS
+  -G ${GENERATOR}
+  -DCMAKE_BUILD_TYPE=Release
+  -DCMAKE_CXX_COMPILER=${CXX_COMPILER}
+  -DDEFAULT_IMAGE_PATH=${DEFAULT_IMAGE_PATH}
+  -DCAFFEINE8_PGO_DIR=${PROFILE_DIR})
+
+function(run_step description)
+  message(STATUS "PGO: ${description}")
+  execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+  if(result)
+    message(FATAL_ERROR "PGO: ${description} failed (${result})")
+  endif()
+endfunction()
+
+run_step("configuring plain build"
+  ${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${PLAIN_DIR} ${COMMON_ARGS} -DCAFFEINE8_PGO=OFF -DCAFFEINE8_LTO=OFF)
+run_step("building plain binary" ${CMAKE_COMMAND} --build ${PLAIN_DIR})
+
+file(REMOVE_RECURSE ${PROFILE_DIR})
+file(MAKE_DIRECTORY ${PROFILE_DIR})
+run_step("configuring instrumented build"
+  ${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${OPTIMIZED_DIR} ${COMMON_ARGS} -DCAFFEINE8_PGO=GENERATE -DCAFFEINE8_LTO=OFF)
+run_step("building instrumented binary" ${CMAKE_COMMAND} --build ${OPTIMIZED_DIR})
+# The samples the workload prints only matter to report.sh; keep them off the console.
+run_step("running training workload, samples in ${BINARY_DIR}/training.txt"
+  sh -c "sh '${SOURCE_DIR}/tools/pgo/train.sh' '${OPTIMIZED_DIR}/src/caffeine8' '${BINARY_DIR}/training' > '${BINARY_DIR}/training.txt'")
+
+if(CXX_COMPILER_ID MATCHES "Clang")
+  if(NOT LLVM_PROFDATA)
+    message(FATAL_ERROR "PGO: llvm-profdata is required to merge Clang profiles")
+  endif()
+  file(GLOB RAW_PROFILES ${PROFILE_DIR}/*.profraw)
+  run_step("merging profiles" ${LLVM_PROFDATA} merge -output=${PROFILE_DIR}/caffeine8.profdata ${RAW_PROFILES})
+endif()
+
+run_step("configuring optimised build"
+  ${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${OPTIMIZED_DIR} ${COMMON_ARGS} -DCAFFEINE8_PGO=USE -DCAFFEINE8_LTO=ON)
+run_step("building optimised binary" ${CMAKE_COMMAND} --build ${OPTIMIZED_DIR} --clean-first)
+
+run_step("comparing binaries"
+  sh -c "sh '${SOURCE_DIR}/tools/pgo/report.sh' '${PLAIN_DIR}/src/caffeine8' '${OPTIMIZED_DIR}/src/caffeine8' '${BINARY_DIR}/report-work' > '${BINARY_DIR}/report.md'")
+message(STATUS "PGO: optimised binary is ${OPTIMIZED_DIR}/src/caffeine8, report in ${BINARY_DIR}/report.md")
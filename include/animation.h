@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAFFEINE_ANIMATION_H
+#define CAFFEINE_ANIMATION_H
+
+#include <cstdint>
+#include <vector>
+#include <X11/Xlib.h>
+
+namespace caffeine8
+{
+
+    /**
+     * @brief Rising steam above the cup in the attach window's banner.
+     *
+     * The frames are built once per banner size from the banner's own steam
+     * pixels and kept as server-side pixmaps; playing a frame is a single
+     * XCopyArea driven by a timerfd. The timer is disarmed while stopped, so
+     * a stopped animation costs nothing.
+     */
+    class SteamAnimation
+    {
+    public:
+        ~SteamAnimation();
+
+        /**
+         * @brief Sets up the animation for a window.
+         *
+         * @param display Display connection to use.
+         * @param win Window the banner is drawn in.
+         * @param banner Unscaled banner image; must outlive the animation.
+         * @return true on success, false if no timer could be created.
+         */
+        bool create(Display *display, Window win, const XImage *banner);
+
+        /**
+         * @brief Sets the size the banner is drawn at, at the window's top left corner.
+         *
+         * Frames for a new size are built on the first timer tick that finds
+         * the size unchanged since the previous one, so a resize drag does not
+         * build them for the sizes it passes through.
+         */
+        void setBannerSize(int scaled_width, int scaled_height);
+
+        /// @brief Returns whether the frames for the current banner size are built.
+        bool framesReady() const { return builtWidth_ == scaledWidth_ && builtHeight_ == scaledHeight_; }
+
+        /// @brief Arms the timer; does nothing if already running.
+        void start();
+
+        /// @brief Disarms the timer; the static banner stays as last drawn.
+        void stop();
+
+        bool running() const { return running_; }
+
+        /// @brief Descriptor that becomes readable when the next frame is due.
+        int timerFd() const { return timerFd_; }
+
+        /**
+         * @brief Consumes the timer expirations and shows the frame that is due.
+         *
+         * Frames missed while the process was busy are skipped, not queued.
+         */
+        void handleTimer();
+
+        /**
+         * @brief Draws the current frame again, e.g. after the banner was redrawn.
+         *
+         * Does nothing until the frames for the current size are built.
+         */
+        void present();
+
+        /// @brief Frames shown since create().
+        unsigned long framesPresented() const { return framesPresented_; }
+
+        /// @brief Total time spent building frame caches, in microseconds.
+        long long buildMicros() const { return buildMicros_; }
+
+        /// @brief Frees the frames and the timer; must be called before the display is closed.
+        void destroy();
+
+    private:
+        void buildFrames();
+        void freeFrames();
+
+        Display *display_ = nullptr;
+        Window win_ = None;
+        GC gc_ = None;
+        const XImage *banner_ = nullptr;
+        int timerFd_ = -1;
+        bool running_ = false;
+        int scaledWidth_ = 0;
+        int scaledHeight_ = 0;
+        int builtWidth_ = 0;    // Banner width the cached frames were built for.
+        int builtHeight_ = 0;   // Banner height the cached frames were built for.
+        int pendingWidth_ = 0;  // Banner size seen by the last tick that did not build.
+        int pendingHeight_ = 0;
+        int regionX_ = 0;       // Steam region in window coordinates.
+        int regionY_ = 0;
+        int regionWidth_ = 0;
+        int regionHeight_ = 0;
+        std::vector<Pixmap> frames_;
+        unsigned int frame_ = 0;
+        unsigned long framesPresented_ = 0;
+        long long buildMicros_ = 0;
+    };
+
+} // namespace caffeine8
+
+#endif // CAFFEINE_ANIMATION_H
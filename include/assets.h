@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAFFEINE_ASSETS_H
+#define CAFFEINE_ASSETS_H
+
+#include <cstddef>
+#include <X11/Xlib.h>
+
+namespace caffeine8
+{
+
+    /**
+     * @brief The decoded banner and title images of the attach window.
+     *
+     * When a daemon is running, the pixels live in a sealed memfd held by the
+     * daemon and every attach window maps the same read-only copy instead of
+     * decoding the XPM files again.
+     */
+    struct BannerAssets
+    {
+        XImage *banner = nullptr;
+        XImage *title = nullptr;
+        void *mapping = nullptr; ///< Shared pixels, or nullptr if the images own their data.
+        size_t mapping_size = 0;
+    };
+
+    /**
+     * @brief Loads the banner and title images for a display.
+     *
+     * Fetches shared pixels from the daemon if it has them for the display's
+     * pixel format; otherwise decodes the XPM files and offers the result to
+     * the daemon.
+     *
+     * @param display Display the images are drawn on.
+     * @param assets Receives the images.
+     * @return true on success, false if the XPM files cannot be read.
+     */
+    bool loadBannerAssets(Display *display, BannerAssets &assets);
+
+    /**
+     * @brief Releases the images and the shared mapping.
+     *
+     * @param assets Images to release.
+     */
+    void freeBannerAssets(BannerAssets &assets);
+
+    /**
+     * @brief Allocates a named colour in the display's default colormap.
+     *
+     * @param display Display the colour is drawn on.
+     * @param name X colour name such as "sea green".
+     * @param fallback Pixel to use if the colour cannot be allocated.
+     * @return The pixel value of the colour.
+     */
+    unsigned long namedColor(Display *display, const char *name, unsigned long fallback);
+
+    /**
+     * @brief Makes a broken display connection set a flag instead of exiting the process.
+     *
+     * Once the flag is set, Xlib calls on the display return without effect;
+     * the caller should close it with XCloseDisplay() and not use it further.
+     *
+     * @param display Display connection to watch.
+     * @param lost Set to true when the connection is lost; must outlive the display.
+     */
+    void watchDisplayLoss(Display *display, bool &lost);
+
+} // namespace caffeine8
+
+#endif // CAFFEINE_ASSETS_H
@@ -30,9 +30,17 @@
 namespace caffeine8
 {
 
-    /// @brief Path to the PID file.
+    /// @brief Path to the PID file, overridden by CAFFEINE8_PID_FILE.
     extern const std::string pidFilePath;
 
+    /**
+     * @brief Interval between keep-awake calls in milliseconds.
+     *
+     * Defaults to one minute; CAFFEINE8_TICK_INTERVAL_MS overrides it for
+     * benchmarks and profile training.
+     */
+    extern const long tickIntervalMs;
+
     /// @brief Last error message from qbus.
     extern std::string lastQbusError;
 
@@ -75,10 +83,70 @@ namespace caffeine8
      */
     void deletePidFile();
 
+    /// @brief Options for the attach window.
+    struct UIOptions
+    {
+        /// Draw per-frame render statistics in the bottom right corner.
+        bool perfOverlay = false;
+
+        /// Write the X events seen by the window to this file, if not empty.
+        std::string recordPath;
+
+        /// Replay the events from this file instead of handling live input, if not empty.
+        std::string replayPath;
+
+        /// Replay batch by batch without waiting for the recorded timing.
+        bool replayFast = false;
+
+        /// Animate the steam above the cup while keep-awake is active.
+        bool animate = true;
+
+        /// Animate for this many seconds regardless of the daemon's state, then print CPU use and quit; 0 to disable.
+        int animationBenchmarkSeconds = 0;
+    };
+
     /**
      * @brief Shows the UI of the application.
+     *
+     * @param options Options for the attach window.
+     */
+    void showUI(const UIOptions &options = UIOptions());
+
+    /**
+     * @brief Shows the keep-awake state as an icon in the system tray.
+     *
+     * The icon follows the state the daemon reports over the control socket
+     * and is only redrawn when that state or the icon size changes.
+     */
+    void showTray();
+
+    /**
+     * @brief Shows the daemon's status in the terminal.
+     *
+     * For use without an X display. Only the cells that change are redrawn
+     * when the daemon reports a new status; nothing runs in between.
+     */
+    void showTui();
+
+    /// @brief Options for the forked daemon.
+    struct DaemonOptions
+    {
+        /// Global key combination that pauses and resumes keep-awake, e.g. "Ctrl+Alt+K"; empty for none.
+        std::string hotkey;
+
+        /// Briefly show the new state on screen when the hotkey is pressed.
+        bool hotkeyOsd = false;
+    };
+
+    /**
+     * @brief Runs the keep-awake loop of the forked daemon.
+     *
+     * Every transition, keep-awake call and error is recorded in the history log.
+     * Returns after SIGTERM or SIGINT once the stop has been recorded.
+     *
+     * @param options Options for the daemon.
      */
-    void showUI();
+    void runDaemon(const DaemonOptions &options = DaemonOptions());
 
 } // namespace caffeine8
 
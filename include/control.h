@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAFFEINE_CONTROL_H
+#define CAFFEINE_CONTROL_H
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <sys/types.h>
+
+namespace caffeine8
+{
+
+    /**
+     * @brief Returns the path of the daemon's control socket.
+     *
+     * The socket lives next to the PID file: /tmp/caffeine8.pid uses /tmp/caffeine8.sock.
+     */
+    std::string controlSocketPath();
+
+    /**
+     * @brief State of the daemon as sent to subscribed clients.
+     */
+    struct DaemonStatus
+    {
+        bool active = true;   ///< Keep-awake is not paused.
+        bool failing = false; ///< The last keep-awake call reported an error.
+        pid_t pid = 0;
+        std::string version;
+        unsigned long ticks = 0;
+        unsigned long errors = 0;
+        std::string last_error; ///< First line of the last error, empty if none.
+    };
+
+    /**
+     * @brief Formats a status message.
+     *
+     * The message is "STATE <active|paused|error> <pid> <version> <ticks> <errors> <last error>".
+     */
+    std::string formatStatus(const DaemonStatus &status);
+
+    /**
+     * @brief Parses a status message.
+     *
+     * @param line Message as produced by formatStatus().
+     * @param status Receives the status.
+     * @return true if the line is a status message, false otherwise.
+     */
+    bool parseStatus(const std::string &line, DaemonStatus &status);
+
+    /**
+     * @brief A stream connection carrying newline-terminated text messages.
+     *
+     * A message may carry one file descriptor as SCM_RIGHTS ancillary data.
+     */
+    class ControlConnection
+    {
+    public:
+        explicit ControlConnection(int fd = -1) : fd_(fd) {}
+        ~ControlConnection();
+        ControlConnection(ControlConnection &&other) noexcept;
+        ControlConnection &operator=(ControlConnection &&other) noexcept;
+        ControlConnection(const ControlConnection &) = delete;
+        ControlConnection &operator=(const ControlConnection &) = delete;
+
+        /**
+         * @brief Connects to the daemon's control socket.
+         *
+         * @return true on success, false if no daemon is listening.
+         */
+        bool connect();
+
+        /**
+         * @brief Connects to the daemon and subscribes to its status.
+         *
+         * The connection is non-blocking afterwards, so receive() returns
+         * once the buffered status messages are consumed.
+         *
+         * @return true on success, false if no daemon is listening.
+         */
+        bool subscribe();
+
+        /**
+         * @brief Sends a message.
+         *
+         * @param line Message text without the trailing newline.
+         * @param passFd File descriptor to pass along, or -1.
+         * @return true on success, false otherwise.
+         */
+        bool send(const std::string &line, int passFd = -1);
+
+        /**
+         * @brief Reads data that is available and returns the next complete message.
+         *
+         * Blocks only if the socket is blocking and no complete message is buffered.
+         *
+         * @param line Receives the message text.
+         * @param receivedFd Receives a passed file descriptor, or -1; the caller owns it.
+         * @return true if a message was returned, false if none is complete yet or the peer closed.
+         */
+        bool receive(std::string &line, int &receivedFd);
+
+        /**
+         * @brief Consumes the buffered messages of a status subscription.
+         *
+         * Messages other than status messages and any passed file descriptors
+         * are discarded. If the daemon went away the connection is closed.
+         *
+         * @param status Receives the latest status.
+         * @return true if a status message arrived.
+         */
+        bool pollStatus(DaemonStatus &status);
+
+        /// @brief Returns whether a complete message is buffered.
+        bool hasMessage() const;
+
+        /// @brief Returns whether the peer closed the connection or an error occurred.
+        bool closed() const { return closed_; }
+
+        /// @brief Closes the connection and any received file descriptor not yet handed out.
+        void close();
+
+        int fd() const { return fd_; }
+
+    private:
+        int fd_ = -1;
+        std::string input_;
+        int pendingFd_ = -1;
+        bool closed_ = false;
+    };
+
+    /**
+     * @brief A status subscription that follows the daemon across restarts.
+     *
+     * While no daemon is listening the subscription is retried every
+     * reconnectIntervalMs; fd() is -1 then and timeoutMs() tells when the
+     * next attempt is due.
+     */
+    class StatusSubscription
+    {
+    public:
+        /// Delay between attempts to reach a daemon that is not running.
+        static const int reconnectIntervalMs = 5000;
+
+        /// @brief Subscribes now; on failure the next attempt is scheduled.
+        void start();
+
+        /**
+         * @brief Reads status messages and retries the subscription when it is due.
+         *
+         * Call whenever poll() returns; it does not block.
+         *
+         * @param status Receives the latest status.
+         * @return true if a status arrived or the daemon went away.
+         */
+        bool update(DaemonStatus &status);
+
+        /// @brief Returns whether a daemon is connected.
+        bool connected() const { return connection_.fd() >= 0; }
+
+        /// @brief Returns whether a status has arrived from the connected daemon.
+        bool known() const { return known_; }
+
+        /// @brief Descriptor to poll for input, or -1 while not connected.
+        int fd() const { return connection_.fd(); }
+
+        /// @brief Milliseconds until the next attempt to subscribe, or -1 while connected.
+        int timeoutMs() const;
+
+    private:
+        ControlConnection connection_;
+        bool known_ = false;
+        std::chrono::steady_clock::time_point retryAt_;
+    };
+
+    /**
+     * @brief The daemon side of the control socket.
+     *
+     * Clients can store a sealed memfd with decoded banner assets under a key
+     * describing the pixel format (PUT-ASSETS <key>) and fetch it again
+     * (GET-ASSETS <key>), so that attach windows share one decoded copy.
+     * After SUBSCRIBE a client receives the current status and then every
+     * change of it, see formatStatus().
+     */
+    class ControlServer
+    {
+    public:
+        ~ControlServer();
+
+        /**
+         * @brief Creates the listening socket, replacing a stale one.
+         *
+         * @param path Path of the socket.
+         * @return true on success, false otherwise.
+         */
+        bool listen(const std::string &path);
+
+        /// @brief Closes all connections, removes the socket and releases the stored assets.
+        void close();
+
+        /**
+         * @brief Appends the descriptors to poll for to a pollfd array.
+         *
+         * @param fds Array to append to.
+         */
+        void addPollFds(std::vector<struct pollfd> &fds) const;
+
+        /**
+         * @brief Handles the readiness poll() reported for the descriptors added by addPollFds().
+         *
+         * @param fds First descriptor added by addPollFds().
+         */
+        void handlePollFds(const struct pollfd *fds);
+
+        /**
+         * @brief Updates the status and sends it to subscribers if it changed.
+         *
+         * @param status New status.
+         */
+        void setStatus(const DaemonStatus &status);
+
+    private:
+        struct Client
+        {
+            ControlConnection connection;
+            bool subscribed = false;
+        };
+
+        void accept();
+        void handleMessage(Client &client, const std::string &line, int receivedFd);
+        bool storeAssets(const std::string &key, int fd);
+
+        int listenFd_ = -1;
+        std::string path_;
+        ino_t inode_ = 0;
+        std::vector<Client> clients_;
+        std::string status_;
+        std::map<std::string, int> assets_;
+        std::deque<std::string> assetOrder_;
+    };
+
+} // namespace caffeine8
+
+#endif // CAFFEINE_CONTROL_H
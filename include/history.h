@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAFFEINE_HISTORY_H
+#define CAFFEINE_HISTORY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace caffeine8
+{
+
+    /// @brief Kind of entry stored in the history log.
+    enum class HistoryEvent : uint32_t
+    {
+        Start = 1, ///< The daemon started keeping the machine awake.
+        Stop = 2,  ///< The daemon stopped keeping the machine awake.
+        Tick = 3,  ///< A keep-awake call was made; aux holds its duration in microseconds.
+        Error = 4, ///< The keep-awake call failed; text holds the start of the error output.
+        Pause = 5, ///< Keep-awake was paused with the hotkey.
+        Resume = 6 ///< Keep-awake was resumed with the hotkey.
+    };
+
+    /// @brief One fixed-size entry of the history log.
+    struct HistoryRecord
+    {
+        int64_t time;  ///< Unix time in seconds.
+        uint32_t type; ///< A HistoryEvent value.
+        uint32_t aux;  ///< Event specific value.
+        char text[48]; ///< NUL-terminated, truncated event text.
+    };
+
+    /// @brief Aggregated totals for one local calendar day.
+    struct DayTotal
+    {
+        int64_t day;           ///< Unix time of local midnight starting the day.
+        int64_t activeSeconds; ///< Seconds the machine was kept awake on that day.
+        uint32_t sessions;     ///< Number of sessions started on that day.
+        uint32_t errors;       ///< Number of failed keep-awake calls on that day.
+    };
+
+    /**
+     * @brief A file mapped into memory with MAP_SHARED.
+     *
+     * Writable mappings can be grown; the file is extended with ftruncate and remapped.
+     */
+    class MappedFile
+    {
+    public:
+        MappedFile() = default;
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        /**
+         * @brief Maps a file, creating it when writable.
+         *
+         * @param path Path of the file.
+         * @param writable Whether to map the file for writing.
+         * @return true on success, false otherwise.
+         */
+        bool open(const std::string &path, bool writable);
+
+        /**
+         * @brief Grows a writable mapping to at least the given size.
+         *
+         * @param bytes Minimum size of the mapping.
+         * @return true on success, false otherwise.
+         */
+        bool reserve(size_t bytes);
+
+        /// @brief Unmaps and closes the file.
+        void close();
+
+        /**
+         * @brief Returns whether the file on disk was replaced or resized since it was mapped.
+         */
+        bool changed() const;
+
+        char *data() const { return data_; }
+        size_t size() const { return size_; }
+        bool isOpen() const { return fd_ >= 0; }
+
+    private:
+        std::string path_;
+        int fd_ = -1;
+        char *data_ = nullptr;
+        size_t size_ = 0;
+        bool writable_ = false;
+    };
+
+    /**
+     * @brief Append-only binary log of keep-awake transitions and errors.
+     *
+     * The log lives in three memory mapped files inside the history directory:
+     * the records themselves, a sparse time index with one entry per
+     * historyIndexStride records, and per-day totals that are updated as
+     * records are appended so that summaries never rescan the log. Tick records
+     * are dropped by periodic compaction once they no longer mark the end of a
+     * session. Only one process appends at a time; openForAppend() waits a
+     * short while for the previous writer to release its lock.
+     */
+    class HistoryLog
+    {
+    public:
+        HistoryLog() = default;
+        ~HistoryLog();
+        HistoryLog(const HistoryLog &) = delete;
+        HistoryLog &operator=(const HistoryLog &) = delete;
+
+        /**
+         * @brief Opens the log for appending, creating it if necessary.
+         *
+         * Files with a foreign or damaged header are moved aside to
+         * <name>.bad and recreated.
+         *
+         * Waits up to ten seconds for a previous writer to release the log,
+         * failing with EWOULDBLOCK after that and with ECANCELED as soon as
+         * cancelFd becomes readable.
+         *
+         * @param dir Directory holding the history files.
+         * @param tickIntervalMs Interval between Tick records. A gap of more
+         *        than about two intervals is not counted as active time.
+         * @param cancelFd Descriptor that ends the wait when readable, e.g. a signalfd; -1 for none.
+         * @return true on success, false otherwise.
+         */
+        bool openForAppend(const std::string &dir, long tickIntervalMs, int cancelFd = -1);
+
+        /**
+         * @brief Opens an existing log for queries.
+         *
+         * @param dir Directory holding the history files.
+         * @return true on success, false if there is no readable log.
+         */
+        bool openReadOnly(const std::string &dir);
+
+        /**
+         * @brief Picks up records appended and compactions done by the writer.
+         *
+         * Only needed for logs opened with openReadOnly().
+         *
+         * @return true on success, false if the log could not be remapped.
+         */
+        bool refresh();
+
+        /**
+         * @brief Appends a record and updates the day totals.
+         *
+         * @param type Kind of event.
+         * @param time Unix time of the event in seconds.
+         * @param aux Event specific value.
+         * @param text Event text, truncated to fit the record.
+         * @return true on success, false otherwise.
+         */
+        bool append(HistoryEvent type, int64_t time, uint32_t aux = 0, const std::string &text = "");
+
+        /**
+         * @brief Returns all records at or after the given time.
+         *
+         * @param since Unix time in seconds.
+         */
+        std::vector<HistoryRecord> recordsSince(int64_t since) const;
+
+        /**
+         * @brief Finds the most recent record of the given type.
+         *
+         * @param type Kind of event to look for.
+         * @param record Receives the record.
+         * @return true if a record was found, false otherwise.
+         */
+        bool lastRecord(HistoryEvent type, HistoryRecord &record) const;
+
+        /**
+         * @brief Returns the totals of all days ending after the given time.
+         *
+         * @param since Unix time in seconds.
+         */
+        std::vector<DayTotal> dayTotalsSince(int64_t since) const;
+
+        /**
+         * @brief Rewrites the log without Tick records that no longer end a session.
+         *
+         * @return true on success, false otherwise.
+         */
+        bool compact();
+
+        /// @brief Number of records currently in the log.
+        uint64_t recordCount() const;
+
+        /// @brief Unmaps the files and releases the writer lock.
+        void close();
+
+    private:
+        bool openFiles(bool writable);
+        bool writable() const;
+        bool addActive(int64_t from, int64_t to);
+        DayTotal *dayTotal(int64_t day);
+        bool rebuildIndex();
+
+        std::string dir_;
+        MappedFile log_;
+        MappedFile index_;
+        MappedFile days_;
+        int lockFd_ = -1;
+        int64_t maxGap_ = 120; // Longest gap between records counted as active, in seconds.
+    };
+
+    /// @brief Number of records covered by each entry of the sparse time index.
+    extern const uint64_t historyIndexStride;
+
+    /// @brief Record count at which the log is compacted, or twice the count after the last compaction if larger.
+    extern const uint64_t historyCompactThreshold;
+
+    /**
+     * @brief Returns the directory holding the history files.
+     *
+     * This is $XDG_STATE_HOME/caffeine8, falling back to ~/.local/state/caffeine8.
+     */
+    std::string historyDirPath();
+
+    /**
+     * @brief Runs the 'history' command.
+     *
+     * @param argc Number of arguments following 'history'.
+     * @param argv Arguments following 'history'.
+     * @return Process exit code.
+     */
+    int runHistoryCommand(int argc, char *argv[]);
+
+} // namespace caffeine8
+
+#endif // CAFFEINE_HISTORY_H
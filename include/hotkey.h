@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAFFEINE_HOTKEY_H
+#define CAFFEINE_HOTKEY_H
+
+#include <chrono>
+#include <string>
+#include <X11/Xlib.h>
+
+namespace caffeine8
+{
+
+    /**
+     * @brief A global key combination grabbed on the root window.
+     *
+     * The grab ignores the state of Caps Lock and Num Lock. Holding the
+     * combination down counts as a single press; autorepeat is ignored.
+     */
+    class Hotkey
+    {
+    public:
+        /**
+         * @brief Parses a key combination and grabs it.
+         *
+         * @param display Display connection that receives the key events.
+         * @param spec Combination such as "Ctrl+Alt+K"; modifiers are Ctrl, Alt, Shift and Super.
+         * @return true on success, false if the combination is invalid or already grabbed by another client.
+         */
+        bool grab(Display *display, const std::string &spec);
+
+        /// @brief Releases the grab.
+        void ungrab();
+
+        /**
+         * @brief Returns whether a key event is a new press of the grabbed combination.
+         *
+         * Releases of the key are tracked here, so every key event for the
+         * grab has to be passed in.
+         *
+         * @param ev Event to check.
+         */
+        bool matches(const XEvent &ev);
+
+    private:
+        Display *display_ = nullptr;
+        KeyCode keycode_ = 0;
+        unsigned int modifiers_ = 0;
+        bool down_ = false;    // The key is held; further presses are autorepeat.
+        Time releaseTime_ = 0; // Time of the last release, to spot repeats without detectable autorepeat.
+    };
+
+    /**
+     * @brief Short on-screen confirmation of the keep-awake state.
+     *
+     * Both messages are drawn once into pixmaps when the display is opened;
+     * showing one only maps a small override-redirect window and copies the
+     * pixmap into it.
+     */
+    class StateOsd
+    {
+    public:
+        ~StateOsd();
+
+        /**
+         * @brief Creates the window and pre-renders the messages.
+         *
+         * @param display Display connection to use.
+         */
+        void create(Display *display);
+
+        /**
+         * @brief Shows the message for a state until the timeout expires.
+         *
+         * @param active Whether keep-awake is active.
+         */
+        void show(bool active);
+
+        /**
+         * @brief Handles an event for the OSD window.
+         *
+         * @param ev Event to handle.
+         * @return true if the event belonged to the OSD window.
+         */
+        bool handleEvent(const XEvent &ev);
+
+        /**
+         * @brief Hides the window once its timeout has expired.
+         *
+         * @param now Current time.
+         */
+        void update(std::chrono::steady_clock::time_point now);
+
+        /// @brief Destroys the window and pixmaps; must be called before the display is closed.
+        void destroy();
+
+        /// @brief Returns whether the window is shown.
+        bool visible() const { return visible_; }
+
+        /// @brief Time at which a visible window is hidden.
+        std::chrono::steady_clock::time_point hideAt() const { return hideAt_; }
+
+    private:
+        Display *display_ = nullptr;
+        Window win_ = None;
+        GC gc_ = None;
+        Pixmap activePixmap_ = None;
+        Pixmap pausedPixmap_ = None;
+        bool active_ = true;
+        bool visible_ = false;
+        std::chrono::steady_clock::time_point hideAt_;
+    };
+
+} // namespace caffeine8
+
+#endif // CAFFEINE_HOTKEY_H
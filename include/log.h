@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAFFEINE_LOG_H
+#define CAFFEINE_LOG_H
+
+#include <string>
+
+namespace caffeine8
+{
+
+    /// @brief Severity of a log message, using the syslog priority values.
+    enum class LogLevel : int
+    {
+        Error = 3,
+        Warning = 4,
+        Info = 6,
+        Debug = 7
+    };
+
+    /**
+     * @brief Starts the background log flusher.
+     *
+     * The target is one of "journal", "syslog", "stderr" or "file:<path>".
+     * "journal" and "syslog" accept an optional ":<socket path>" suffix to send
+     * to a socket other than the system one. An empty target selects the
+     * CAFFEINE8_LOG environment variable, falling back to the journal when its
+     * socket exists and to syslog otherwise. Messages below the level given by
+     * CAFFEINE8_LOG_LEVEL (error, warning, info or debug; default info) are
+     * discarded without being queued.
+     *
+     * Must be called after fork(), as the flusher thread does not survive it.
+     *
+     * @param target Where to write log messages.
+     * @return true on success, false if the target could not be opened.
+     */
+    bool startLogger(const std::string &target = "");
+
+    /**
+     * @brief Flushes all queued messages and stops the flusher.
+     */
+    void stopLogger();
+
+    /**
+     * @brief Returns whether messages of the given level are currently written.
+     *
+     * @param level Severity to check.
+     */
+    bool logEnabled(LogLevel level);
+
+    /**
+     * @brief Queues a printf-style log message.
+     *
+     * The message is formatted into a fixed-size record and pushed onto a
+     * lock-free queue without blocking; it is dropped and counted if the
+     * queue is full. Messages longer than the record are truncated.
+     *
+     * @param level Severity of the message.
+     * @param format printf-style format string.
+     */
+    void logMessage(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+} // namespace caffeine8
+
+#endif // CAFFEINE_LOG_H
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAFFEINE_REPLAY_H
+#define CAFFEINE_REPLAY_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <X11/Xlib.h>
+
+namespace caffeine8
+{
+
+    /// @brief One X event of a recorded attach window session.
+    struct RecordedEvent
+    {
+        uint32_t delta_us; ///< Time since the previous event in microseconds.
+        uint16_t type;     ///< X event type.
+        uint16_t flags;    ///< RecordedEvent::EndOfBatch if the event loop rendered after this event.
+        int16_t x;         ///< Geometry of ConfigureNotify and Expose events.
+        int16_t y;
+        uint16_t width;
+        uint16_t height;
+
+        static const uint16_t EndOfBatch = 1;
+    };
+
+    /// @brief A recorded attach window session.
+    struct EventTrace
+    {
+        uint16_t width;  ///< Window width when recording started.
+        uint16_t height; ///< Window height when recording started.
+        std::vector<RecordedEvent> events;
+    };
+
+    /**
+     * @brief Writes the X events seen by showUI() to a compact binary file.
+     *
+     * The file holds a 16 byte header followed by one 16 byte RecordedEvent
+     * per event. Each event is held back until the next one arrives so that
+     * the end of a batch can be marked on it.
+     */
+    class EventRecorder
+    {
+    public:
+        ~EventRecorder();
+
+        /**
+         * @brief Creates the trace file.
+         *
+         * @param path Path of the trace file.
+         * @param width Window width when recording starts.
+         * @param height Window height when recording starts.
+         * @return true on success, false otherwise.
+         */
+        bool open(const std::string &path, int width, int height);
+
+        /**
+         * @brief Records an event.
+         *
+         * @param ev Event as returned by XNextEvent().
+         */
+        void record(const XEvent &ev);
+
+        /// @brief Marks the last recorded event as the end of an event loop batch.
+        void endBatch();
+
+        /// @brief Writes the held back event and closes the file.
+        void close();
+
+        bool isOpen() const { return file_ != nullptr; }
+
+    private:
+        void flushPending();
+
+        FILE *file_ = nullptr;
+        RecordedEvent pending_;
+        bool hasPending_ = false;
+        std::chrono::steady_clock::time_point last_;
+    };
+
+    /**
+     * @brief Reads a trace written by EventRecorder.
+     *
+     * @param path Path of the trace file.
+     * @param trace Receives the trace.
+     * @return true on success, false if the file is missing or malformed.
+     */
+    bool loadEventTrace(const std::string &path, EventTrace &trace);
+
+    /**
+     * @brief Turns a recorded event back into an XEvent for the given window.
+     *
+     * @param recorded Recorded event.
+     * @param win Window the event is delivered to.
+     * @param ev Receives the event.
+     */
+    void toXEvent(const RecordedEvent &recorded, Window win, XEvent &ev);
+
+} // namespace caffeine8
+
+#endif // CAFFEINE_REPLAY_H
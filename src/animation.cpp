@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <X11/Xutil.h>
+#include "animation.h"
+#include "log.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        /// Frames in one loop of the animation.
+        const int steamFrames = 16;
+
+        /// Upper bound on the playback rate; steam does not need more.
+        const int steamFps = 10;
+
+        /// Steam above the cup in banner.xpm coordinates, with room for the sway.
+        const int steamLeft = 236;
+        const int steamTop = 8;
+        const int steamRight = 436;
+        const int steamBottom = 318;
+
+        /// Largest sideways displacement at the top of the steam, in banner pixels.
+        const double swayAmplitude = 7.0;
+
+        /// Height of one wave of the sway, in banner pixels.
+        const double swayWavelength = 150.0;
+
+        const double pi = 3.14159265358979323846;
+    } // namespace
+
+    SteamAnimation::~SteamAnimation()
+    {
+        destroy();
+    }
+
+    bool SteamAnimation::create(Display *display, Window win, const XImage *banner)
+    {
+        destroy();
+        timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (timerFd_ < 0)
+        {
+            return false;
+        }
+        display_ = display;
+        win_ = win;
+        gc_ = XCreateGC(display, win, 0, NULL);
+        banner_ = banner;
+        return true;
+    }
+
+    void SteamAnimation::setBannerSize(int scaled_width, int scaled_height)
+    {
+        scaledWidth_ = scaled_width;
+        scaledHeight_ = scaled_height;
+    }
+
+    void SteamAnimation::start()
+    {
+        if (running_ || display_ == nullptr)
+        {
+            return;
+        }
+        struct itimerspec spec = {};
+        spec.it_interval.tv_nsec = 1000000000L / steamFps;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(timerFd_, 0, &spec, NULL);
+        running_ = true;
+    }
+
+    void SteamAnimation::stop()
+    {
+        if (!running_)
+        {
+            return;
+        }
+        struct itimerspec spec = {};
+        timerfd_settime(timerFd_, 0, &spec, NULL);
+        running_ = false;
+    }
+
+    void SteamAnimation::handleTimer()
+    {
+        uint64_t expirations = 0;
+        if (read(timerFd_, &expirations, sizeof(expirations)) != sizeof(expirations) || !running_)
+        {
+            return;
+        }
+        frame_ = (frame_ + expirations) % steamFrames;
+        if (!framesReady() && scaledWidth_ > 0 && scaledHeight_ > 0)
+        {
+            // A resize drag changes the size on nearly every tick; build only
+            // once it has held for a whole tick and keep the static banner
+            // until then.
+            if (scaledWidth_ != pendingWidth_ || scaledHeight_ != pendingHeight_)
+            {
+                pendingWidth_ = scaledWidth_;
+                pendingHeight_ = scaledHeight_;
+                return;
+            }
+            buildFrames();
+        }
+        present();
+    }
+
+    void SteamAnimation::present()
+    {
+        if (display_ == nullptr || !framesReady() || frames_.empty())
+        {
+            return;
+        }
+        XCopyArea(display_, frames_[frame_], win_, gc_, 0, 0, regionWidth_, regionHeight_, regionX_, regionY_);
+        XFlush(display_);
+        framesPresented_++;
+    }
+
+    /**
+     * Each frame samples the banner's steam like the static frame does
+     * (nearest neighbour at the same scale) but shifts every row sideways
+     * along a sine wave that travels upwards over the loop. The shift fades
+     * to nothing at the rim, so the steam stays attached to the cup and the
+     * frames join the static banner without a seam.
+     */
+    void SteamAnimation::buildFrames()
+    {
+        auto buildStart = std::chrono::steady_clock::now();
+        freeFrames();
+        builtWidth_ = scaledWidth_;
+        builtHeight_ = scaledHeight_;
+
+        double x_ratio = static_cast<double>(banner_->width) / scaledWidth_;
+        double y_ratio = static_cast<double>(banner_->height) / scaledHeight_;
+        regionX_ = static_cast<int>(std::ceil(steamLeft / x_ratio));
+        regionY_ = static_cast<int>(std::ceil(steamTop / y_ratio));
+        regionWidth_ = std::min(static_cast<int>(steamRight / x_ratio), scaledWidth_) - regionX_;
+        regionHeight_ = std::min(static_cast<int>(steamBottom / y_ratio), scaledHeight_) - regionY_;
+        if (regionWidth_ <= 0 || regionHeight_ <= 0 || banner_->width <= steamRight || banner_->height <= steamBottom)
+        {
+            return;
+        }
+
+        int screen = DefaultScreen(display_);
+        XImage *image = XCreateImage(display_, DefaultVisual(display_, screen), banner_->depth, ZPixmap, 0, NULL,
+                                     regionWidth_, regionHeight_, 32, 0);
+        image->data = static_cast<char *>(malloc(static_cast<size_t>(image->bytes_per_line) * regionHeight_));
+
+        // XGetPixel takes a non-const image but does not modify it.
+        XImage *banner = const_cast<XImage *>(banner_);
+        for (int f = 0; f < steamFrames; ++f)
+        {
+            double phase = 2.0 * pi * f / steamFrames;
+            for (int y = 0; y < regionHeight_; ++y)
+            {
+                int py = static_cast<int>((regionY_ + y) * y_ratio);
+                double rise = static_cast<double>(steamBottom - py) / (steamBottom - steamTop);
+                int shift = static_cast<int>(std::lround(swayAmplitude * rise * std::sin(2.0 * pi * py / swayWavelength + phase)));
+                for (int x = 0; x < regionWidth_; ++x)
+                {
+                    int px = std::min(std::max(static_cast<int>((regionX_ + x) * x_ratio) - shift, steamLeft), steamRight);
+                    XPutPixel(image, x, y, XGetPixel(banner, px, py));
+                }
+            }
+            Pixmap pixmap = XCreatePixmap(display_, win_, regionWidth_, regionHeight_, banner_->depth);
+            XPutImage(display_, pixmap, gc_, image, 0, 0, 0, 0, regionWidth_, regionHeight_);
+            frames_.push_back(pixmap);
+        }
+        XDestroyImage(image);
+
+        long long micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - buildStart).count();
+        buildMicros_ += micros;
+        logMessage(LogLevel::Debug, "Built %d steam frames of %dx%d in %lld us", steamFrames, regionWidth_, regionHeight_, micros);
+    }
+
+    void SteamAnimation::freeFrames()
+    {
+        for (Pixmap pixmap : frames_)
+        {
+            XFreePixmap(display_, pixmap);
+        }
+        frames_.clear();
+        builtWidth_ = 0;
+        builtHeight_ = 0;
+    }
+
+    void SteamAnimation::destroy()
+    {
+        if (display_ != nullptr)
+        {
+            freeFrames();
+            XFreeGC(display_, gc_);
+            display_ = nullptr;
+        }
+        if (timerFd_ >= 0)
+        {
+            close(timerFd_);
+            timerFd_ = -1;
+        }
+        running_ = false;
+    }
+
+} // namespace caffeine8
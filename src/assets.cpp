@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "assets.h"
+#include "caffeine8.h"
+#include "control.h"
+#include "log.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        const char assetMagic[8] = {'C', '8', 'A', 'S', 'S', 'E', 'T', '1'};
+
+        /// Offset of the banner pixels; the title follows at the next multiple of it.
+        const size_t assetAlignment = 64;
+
+        /// How long to wait for the daemon before decoding locally.
+        const int replyTimeoutMs = 1000;
+
+        struct AssetHeader
+        {
+            char magic[8];
+            uint32_t depth;
+            uint32_t bits_per_pixel;
+            uint32_t banner_width;
+            uint32_t banner_height;
+            uint32_t banner_bytes_per_line;
+            uint32_t title_width;
+            uint32_t title_height;
+            uint32_t title_bytes_per_line;
+        };
+
+        static_assert(sizeof(AssetHeader) <= assetAlignment, "AssetHeader does not fit before the pixels");
+
+        /// Pixel layout of the default visual; images are only shared between identical layouts.
+        struct PixelFormat
+        {
+            int depth = 0;
+            int bits_per_pixel = 0;
+            int scanline_pad = 0;
+        };
+
+        size_t alignUp(size_t value)
+        {
+            return (value + assetAlignment - 1) / assetAlignment * assetAlignment;
+        }
+
+        bool pixelFormat(Display *display, PixelFormat &format)
+        {
+            int screen = DefaultScreen(display);
+            format.depth = DefaultDepth(display, screen);
+            int count = 0;
+            XPixmapFormatValues *formats = XListPixmapFormats(display, &count);
+            for (int i = 0; i < count; ++i)
+            {
+                if (formats[i].depth == format.depth)
+                {
+                    format.bits_per_pixel = formats[i].bits_per_pixel;
+                    format.scanline_pad = formats[i].scanline_pad;
+                }
+            }
+            XFree(formats);
+            return format.bits_per_pixel != 0;
+        }
+
+        /**
+         * Names the decoded pixels: the pixel layout of the visual and the
+         * identity of both XPM files. Only TrueColor and DirectColor visuals
+         * qualify, because elsewhere pixel values are colormap entries
+         * allocated by the client that decoded the files.
+         */
+        bool assetKey(Display *display, const PixelFormat &format, std::string &key)
+        {
+            Visual *visual = DefaultVisual(display, DefaultScreen(display));
+            if (visual->c_class != TrueColor && visual->c_class != DirectColor)
+            {
+                return false;
+            }
+
+            std::ostringstream out;
+            out << format.depth << '/' << format.bits_per_pixel << '/' << format.scanline_pad << '/'
+                << (ImageByteOrder(display) == MSBFirst ? "msb" : "lsb") << std::hex << '/'
+                << visual->red_mask << '/' << visual->green_mask << '/' << visual->blue_mask << std::dec;
+            for (const char *path : {DEFAULT_BANNER_IMAGE_PATH, DEFAULT_TITLE_IMAGE_PATH})
+            {
+                struct stat st;
+                if (stat(path, &st) != 0)
+                {
+                    return false;
+                }
+                out << '/' << st.st_ino << ':' << st.st_size << ':' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec;
+            }
+            key = out.str();
+            return true;
+        }
+
+        XImage *imageAt(Display *display, const PixelFormat &format, char *data, uint32_t width, uint32_t height, uint32_t bytes_per_line)
+        {
+            if (width == 0 || height == 0 || bytes_per_line < (static_cast<uint64_t>(width) * format.bits_per_pixel + 7) / 8)
+            {
+                return nullptr;
+            }
+            XImage *image = XCreateImage(display, DefaultVisual(display, DefaultScreen(display)), format.depth, ZPixmap, 0, data,
+                                         width, height, format.scanline_pad, bytes_per_line);
+            if (image != nullptr && image->bits_per_pixel != format.bits_per_pixel)
+            {
+                image->data = nullptr;
+                XDestroyImage(image);
+                return nullptr;
+            }
+            return image;
+        }
+
+        /// Points the images at a mapped memfd after checking that it matches the display.
+        bool mapAssets(Display *display, const PixelFormat &format, int fd, BannerAssets &assets)
+        {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(assetAlignment))
+            {
+                return false;
+            }
+            size_t size = st.st_size;
+            void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                return false;
+            }
+
+            const AssetHeader *header = static_cast<const AssetHeader *>(mapping);
+            size_t banner_bytes = static_cast<size_t>(header->banner_bytes_per_line) * header->banner_height;
+            size_t title_offset = assetAlignment + alignUp(banner_bytes);
+            size_t title_bytes = static_cast<size_t>(header->title_bytes_per_line) * header->title_height;
+            if (std::memcmp(header->magic, assetMagic, sizeof(assetMagic)) != 0 ||
+                header->depth != static_cast<uint32_t>(format.depth) ||
+                header->bits_per_pixel != static_cast<uint32_t>(format.bits_per_pixel) ||
+                title_offset + title_bytes > size)
+            {
+                munmap(mapping, size);
+                return false;
+            }
+
+            // XImage wants non-const data, but nothing draws into these images.
+            char *base = static_cast<char *>(mapping);
+            assets.banner = imageAt(display, format, base + assetAlignment, header->banner_width, header->banner_height, header->banner_bytes_per_line);
+            assets.title = imageAt(display, format, base + title_offset, header->title_width, header->title_height, header->title_bytes_per_line);
+            assets.mapping = mapping;
+            assets.mapping_size = size;
+            if (assets.banner == nullptr || assets.title == nullptr)
+            {
+                freeBannerAssets(assets);
+                return false;
+            }
+            return true;
+        }
+
+        bool writeAll(int fd, const char *data, size_t size)
+        {
+            while (size > 0)
+            {
+                ssize_t n = write(fd, data, size);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    return false;
+                }
+                data += n;
+                size -= n;
+            }
+            return true;
+        }
+
+        /// Copies decoded images into a sealed memfd; returns the descriptor or -1.
+        int createAssetMemfd(const PixelFormat &format, const XImage *banner, const XImage *title)
+        {
+            int fd = memfd_create("caffeine8-assets", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (fd < 0)
+            {
+                return -1;
+            }
+
+            char header_block[assetAlignment] = {};
+            AssetHeader header;
+            std::memcpy(header.magic, assetMagic, sizeof(assetMagic));
+            header.depth = format.depth;
+            header.bits_per_pixel = format.bits_per_pixel;
+            header.banner_width = banner->width;
+            header.banner_height = banner->height;
+            header.banner_bytes_per_line = banner->bytes_per_line;
+            header.title_width = title->width;
+            header.title_height = title->height;
+            header.title_bytes_per_line = title->bytes_per_line;
+            std::memcpy(header_block, &header, sizeof(header));
+
+            size_t banner_bytes = static_cast<size_t>(banner->bytes_per_line) * banner->height;
+            size_t title_bytes = static_cast<size_t>(title->bytes_per_line) * title->height;
+            static const char padding[assetAlignment] = {};
+            bool ok = writeAll(fd, header_block, sizeof(header_block)) &&
+                      writeAll(fd, banner->data, banner_bytes) &&
+                      writeAll(fd, padding, alignUp(banner_bytes) - banner_bytes) &&
+                      writeAll(fd, title->data, title_bytes) &&
+                      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+            if (!ok)
+            {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        bool decodeAssets(Display *display, BannerAssets &assets)
+        {
+            XpmAttributes attributes;
+            attributes.valuemask = 0;
+            if (XpmReadFileToImage(display, DEFAULT_BANNER_IMAGE_PATH, &assets.banner, NULL, &attributes) != XpmSuccess)
+            {
+                std::cerr << "Cannot read Banner XPM file directly" << std::endl;
+                return false;
+            }
+            attributes.valuemask = 0;
+            if (XpmReadFileToImage(display, DEFAULT_TITLE_IMAGE_PATH, &assets.title, NULL, &attributes) != XpmSuccess)
+            {
+                std::cerr << "Cannot read Title XPM file directly" << std::endl;
+                XDestroyImage(assets.banner);
+                assets.banner = nullptr;
+                return false;
+            }
+            return true;
+        }
+    } // namespace
+
+    bool loadBannerAssets(Display *display, BannerAssets &assets)
+    {
+        PixelFormat format;
+        std::string key;
+        ControlConnection daemon;
+        bool shareable = pixelFormat(display, format) && assetKey(display, format, key) && daemon.connect();
+        if (shareable)
+        {
+            struct timeval timeout = {replyTimeoutMs / 1000, (replyTimeoutMs % 1000) * 1000};
+            setsockopt(daemon.fd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            std::string reply;
+            int fd = -1;
+            if (daemon.send("GET-ASSETS " + key) && daemon.receive(reply, fd) && reply == "ASSETS" && fd >= 0)
+            {
+                bool mapped = mapAssets(display, format, fd, assets);
+                close(fd);
+                if (mapped)
+                {
+                    logMessage(LogLevel::Debug, "Mapped shared banner assets (%zu bytes)", assets.mapping_size);
+                    return true;
+                }
+                logMessage(LogLevel::Warning, "Ignoring shared banner assets that do not match the display");
+            }
+            else if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+
+        if (!decodeAssets(display, assets))
+        {
+            return false;
+        }
+        if (!shareable)
+        {
+            return true;
+        }
+
+        // Offer the decoded pixels to the daemon, then drop the private copy
+        // in favour of the sealed one the next windows will map too.
+        int fd = createAssetMemfd(format, assets.banner, assets.title);
+        if (fd < 0)
+        {
+            logMessage(LogLevel::Warning, "Cannot create shared banner assets: %s", strerror(errno));
+            return true;
+        }
+        std::string reply;
+        int unused = -1;
+        if (daemon.send("PUT-ASSETS " + key, fd) && daemon.receive(reply, unused) && reply != "OK")
+        {
+            logMessage(LogLevel::Warning, "Daemon refused shared banner assets: %s", reply.c_str());
+        }
+        if (unused >= 0)
+        {
+            close(unused);
+        }
+
+        BannerAssets shared;
+        if (mapAssets(display, format, fd, shared))
+        {
+            freeBannerAssets(assets);
+            assets = shared;
+        }
+        close(fd);
+        return true;
+    }
+
+    void freeBannerAssets(BannerAssets &assets)
+    {
+        for (XImage **image : {&assets.banner, &assets.title})
+        {
+            if (*image == nullptr)
+            {
+                continue;
+            }
+            if (assets.mapping != nullptr)
+            {
+                (*image)->data = nullptr; // Borrowed from the mapping.
+            }
+            XDestroyImage(*image);
+            *image = nullptr;
+        }
+        if (assets.mapping != nullptr)
+        {
+            munmap(assets.mapping, assets.mapping_size);
+            assets.mapping = nullptr;
+            assets.mapping_size = 0;
+        }
+    }
+
+    unsigned long namedColor(Display *display, const char *name, unsigned long fallback)
+    {
+        XColor color;
+        XColor exact;
+        if (XAllocNamedColor(display, DefaultColormap(display, DefaultScreen(display)), name, &color, &exact))
+        {
+            return color.pixel;
+        }
+        return fallback;
+    }
+
+    void watchDisplayLoss(Display *display, bool &lost)
+    {
+        // Called by Xlib instead of exit() once the connection is broken.
+        XSetIOErrorExitHandler(display, [](Display *, void *flag)
+                               { *static_cast<bool *>(flag) = true; },
+                               &lost);
+    }
+
+} // namespace caffeine8
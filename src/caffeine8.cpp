@@ -15,17 +15,29 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <poll.h>
 #include <signal.h>
-#include <sstream>
+#include <sys/signalfd.h>
+#include <vector>
+#include "assets.h"
 #include "caffeine8.h"
+#include "control.h"
+#include "history.h"
+#include "hotkey.h"
+#include "log.h"
 
 namespace caffeine8
 {
     const std::string BANNER_IMAGE_PATH = DEFAULT_BANNER_IMAGE_PATH;
     const std::string TITLE_IMAGE_PATH = DEFAULT_TITLE_IMAGE_PATH;
-    const std::string pidFilePath = "/tmp/caffeine8.pid";
+    const std::string pidFilePath = getenv("CAFFEINE8_PID_FILE") != NULL ? getenv("CAFFEINE8_PID_FILE") : "/tmp/caffeine8.pid";
+    const long tickIntervalMs = getenv("CAFFEINE8_TICK_INTERVAL_MS") != NULL ? std::max(1L, atol(getenv("CAFFEINE8_TICK_INTERVAL_MS"))) : 60000;
     const std::string VERSION = "1.0.0"; // Version property
     std::string lastQbusError = "NONE";  // Global variable for last qbus error
 
@@ -66,128 +78,241 @@ namespace caffeine8
         }
     }
 
-    void showUI()
+    namespace
     {
-        Display *display = XOpenDisplay(NULL);
-        if (display == NULL)
+        /**
+         * Makes one keep-awake call and records it, and any error it reports,
+         * in the history log and the status sent to subscribers.
+         */
+        void keepAwakeTick(HistoryLog &history, DaemonStatus &status)
         {
-            std::cerr << "Cannot open display" << std::endl;
-            return;
-        }
-
-        int screen = DefaultScreen(display);
-        Window root = RootWindow(display, screen);
-        Window win = XCreateSimpleWindow(display, root, 10, 10, 900, 290, 1, BlackPixel(display, screen), BlackPixel(display, screen));
-
-        XSelectInput(display, win, ExposureMask | KeyPressMask | StructureNotifyMask);
-        XMapWindow(display, win);
-
-        XEvent ev;
-        Pixmap banner_pixmap;
-        XpmAttributes banner_attributes;
-        banner_attributes.valuemask = 0;
-        Pixmap title_pixmap;
-        XpmAttributes title_attributes;
-        title_attributes.valuemask = 0;
+            std::string errorOutput;
+            auto callStart = std::chrono::steady_clock::now();
+            std::chrono::microseconds callTime(0);
+            FILE *fp = popen("qdbus org.freedesktop.ScreenSaver /ScreenSaver SimulateUserActivity 2>&1", "r");
+            if (fp == NULL)
+            {
+                lastQbusError = "Failed to run qdbus command";
+                logMessage(LogLevel::Error, "Failed to run qdbus command: %s", strerror(errno));
+                history.append(HistoryEvent::Error, std::time(nullptr), 0, lastQbusError);
+                status.errors++;
+                status.last_error = lastQbusError;
+            }
+            else
+            {
+                char buffer[128];
+                while (fgets(buffer, sizeof(buffer), fp) != NULL)
+                {
+                    errorOutput += buffer;
+                }
+                pclose(fp);
+                callTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - callStart);
+                history.append(HistoryEvent::Tick, std::time(nullptr), static_cast<uint32_t>(callTime.count()));
+                status.ticks++;
+                if (!errorOutput.empty())
+                {
+                    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+                    lastQbusError = std::ctime(&now);
+                    lastQbusError += ": " + errorOutput;
+                    history.append(HistoryEvent::Error, now, 0, errorOutput.substr(0, errorOutput.find('\n')));
+                    logMessage(LogLevel::Warning, "qdbus failed: %s", errorOutput.c_str());
+                    status.errors++;
+                    status.last_error = errorOutput.substr(0, errorOutput.find('\n'));
+                }
+            }
+            status.failing = fp == NULL || !errorOutput.empty();
 
-        GC gc = XCreateGC(display, win, 0, NULL);
+            auto tickTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - callStart);
+            logMessage(LogLevel::Debug, "Tick took %lld us (keep-awake call %lld us)", static_cast<long long>(tickTime.count()), static_cast<long long>(callTime.count()));
+        }
+    } // namespace
 
-        if (XpmReadFileToPixmap(display, win, DEFAULT_BANNER_IMAGE_PATH, &banner_pixmap, NULL, &banner_attributes) != XpmSuccess)
+    void runDaemon(const DaemonOptions &options)
+    {
+        // SIGTERM from 'stop' or a replacing 'start' is read from a signalfd
+        // below so the session end can be recorded.
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGTERM);
+        sigaddset(&stopSignals, SIGINT);
+        sigprocmask(SIG_BLOCK, &stopSignals, NULL);
+        int signalFd = signalfd(-1, &stopSignals, SFD_CLOEXEC);
+
+        // Opening the history first creates the state directory the log
+        // falls back to. A stop request while waiting for another daemon's
+        // lock is left pending for the loop below.
+        HistoryLog history;
+        bool historyOpen = history.openForAppend(historyDirPath(), tickIntervalMs, signalFd);
+        int historyError = errno;
+
+        // The daemon's stderr is the terminal that started it, which is
+        // usually gone by now, so diagnostics go to the log sink instead.
+        // Without a journal or syslog socket they go to a file next to the
+        // history, and to stderr only as a last resort.
+        if (!startLogger())
         {
-            std::cerr << "Cannot read Banner XPM file directly" << std::endl;
-            return;
+            std::string fallback = historyDirPath() + "/caffeine8.log";
+            if (startLogger("file:" + fallback))
+            {
+                logMessage(LogLevel::Warning, "Log socket unavailable, logging to %s", fallback.c_str());
+            }
+            else if (startLogger("stderr"))
+            {
+                logMessage(LogLevel::Warning, "Log socket and %s unavailable, logging to stderr", fallback.c_str());
+            }
         }
+        logMessage(LogLevel::Info, "caffeine8 %s started with PID %d", VERSION.c_str(), getpid());
 
-        if (XpmReadFileToPixmap(display, win, DEFAULT_TITLE_IMAGE_PATH, &title_pixmap, NULL, &title_attributes) != XpmSuccess)
+        if (!historyOpen && historyError == EWOULDBLOCK)
         {
-            std::cerr << "Cannot read Title XPM file directly" << std::endl;
-            return;
+            logMessage(LogLevel::Error, "History log in %s is locked by another caffeine8 process, not recording history", historyDirPath().c_str());
+        }
+        else if (!historyOpen && historyError != ECANCELED)
+        {
+            logMessage(LogLevel::Error, "Could not open history log in %s: %s", historyDirPath().c_str(), strerror(historyError));
+        }
+        history.append(HistoryEvent::Start, std::time(nullptr));
+
+        // The hotkey is handled on a connection kept open for the daemon's
+        // lifetime, so toggling needs neither a new process nor a new connection.
+        Display *display = NULL;
+        bool displayLost = false;
+        Hotkey hotkey;
+        StateOsd osd;
+        if (!options.hotkey.empty())
+        {
+            display = XOpenDisplay(NULL);
+            if (display == NULL)
+            {
+                logMessage(LogLevel::Error, "Cannot open display, hotkey %s is disabled", options.hotkey.c_str());
+            }
+            else if (!hotkey.grab(display, options.hotkey))
+            {
+                logMessage(LogLevel::Error, "Cannot grab hotkey %s; it is invalid or in use by another client", options.hotkey.c_str());
+                XCloseDisplay(display);
+                display = NULL;
+            }
+            else
+            {
+                fcntl(ConnectionNumber(display), F_SETFD, FD_CLOEXEC);
+                // Losing the X server drops the hotkey, not keep-awake.
+                watchDisplayLoss(display, displayLost);
+                if (options.hotkeyOsd)
+                {
+                    osd.create(display);
+                }
+                logMessage(LogLevel::Info, "Hotkey %s toggles keep-awake", options.hotkey.c_str());
+            }
         }
 
-        XImage *banner = XGetImage(display, banner_pixmap, 0, 0, banner_attributes.width, banner_attributes.height, AllPlanes, ZPixmap);
-        XImage *title = XGetImage(display, title_pixmap, 0, 0, title_attributes.width, title_attributes.height, AllPlanes, ZPixmap);
-
-        pid_t myPid = getpid(); // Get the PID of the current process
-
+        // Attach windows fetch and publish shared decoded assets here, and
+        // tray icons subscribe to the status.
+        ControlServer control;
+        if (!control.listen(controlSocketPath()))
+        {
+            logMessage(LogLevel::Warning, "Cannot listen on %s: %s", controlSocketPath().c_str(), strerror(errno));
+        }
+        DaemonStatus status;
+        status.pid = getpid();
+        status.version = VERSION;
+        control.setStatus(status);
+
+        const auto interval = std::chrono::milliseconds(tickIntervalMs);
+        bool active = true;
+        auto nextTick = std::chrono::steady_clock::now();
         while (true)
         {
-            XNextEvent(display, &ev);
-            if (ev.type == Expose || ev.type == ConfigureNotify)
+            auto now = std::chrono::steady_clock::now();
+            if (active && now >= nextTick)
             {
-                int win_width = ev.xconfigure.width;
-                int win_height = ev.xconfigure.height;
-
-                XSetForeground(display, gc, BlackPixel(display, screen));
-                XFillRectangle(display, win, gc, 0, 0, win_width, win_height);
-
-                float x_scale = static_cast<float>(win_width) / banner_attributes.width;
-                float y_scale = static_cast<float>(win_height) / banner_attributes.height;
-                float scale = std::min(x_scale, y_scale);
+                keepAwakeTick(history, status);
+                control.setStatus(status);
+                nextTick = std::chrono::steady_clock::now() + interval;
+            }
+            osd.update(now);
 
-                int scaled_width = static_cast<int>(banner_attributes.width * scale);
-                int scaled_height = static_cast<int>(banner_attributes.height * scale);
+            // Sleep until the next tick, the OSD timeout, a signal, a key press or a control message.
+            now = std::chrono::steady_clock::now();
+            long long timeoutMs = -1;
+            if (active)
+            {
+                timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - now).count() + 1;
+            }
+            if (osd.visible())
+            {
+                long long hideMs = std::chrono::duration_cast<std::chrono::milliseconds>(osd.hideAt() - now).count() + 1;
+                timeoutMs = timeoutMs < 0 ? hideMs : std::min(timeoutMs, hideMs);
+            }
+            if (display != NULL)
+            {
+                XFlush(display);
+            }
 
-                XImage *scaled_image = XCreateImage(display, DefaultVisual(display, screen), banner->depth, ZPixmap, 0, NULL, scaled_width, scaled_height, 32, 0);
-                scaled_image->data = (char *)malloc(scaled_image->bytes_per_line * scaled_height);
+            std::vector<struct pollfd> fds = {{signalFd, POLLIN, 0}, {display != NULL ? ConnectionNumber(display) : -1, POLLIN, 0}};
+            control.addPollFds(fds);
+            bool queued = display != NULL && XEventsQueued(display, QueuedAlready) > 0;
+            if (!queued && poll(fds.data(), fds.size(), static_cast<int>(std::max(0LL, timeoutMs))) < 0 && errno != EINTR)
+            {
+                logMessage(LogLevel::Error, "poll failed: %s", strerror(errno));
+            }
 
-                float x_ratio = (float)banner_attributes.width / (float)scaled_width;
-                float y_ratio = (float)banner_attributes.height / (float)scaled_height;
+            if (fds[0].revents & POLLIN)
+            {
+                history.append(HistoryEvent::Stop, std::time(nullptr));
+                logMessage(LogLevel::Info, "caffeine8 stopped");
+                break;
+            }
+            control.handlePollFds(&fds[2]);
 
-                for (int y = 0; y < scaled_height; ++y)
+            while (display != NULL && XPending(display) > 0)
+            {
+                XEvent ev;
+                XNextEvent(display, &ev);
+                auto keyTime = std::chrono::steady_clock::now();
+                if (osd.handleEvent(ev) || !hotkey.matches(ev))
                 {
-                    for (int x = 0; x < scaled_width; ++x)
-                    {
-                        int px = (int)(x * x_ratio);
-                        int py = (int)(y * y_ratio);
-                        XPutPixel(scaled_image, x, y, XGetPixel(banner, px, py));
-                    }
+                    continue;
                 }
 
-                XPutImage(display, win, gc, scaled_image, 0, 0, 0, 0, scaled_width, scaled_height);
-
-                free(scaled_image->data);
-                scaled_image->data = NULL;
-                XDestroyImage(scaled_image);
-
-                int line_height = 20;      // Height of each line in pixels
-                int x = scaled_width + 20; // X position where text starts
-                int y = 70;                // Initial Y position where text starts
-
-                XPutImage(display, win, gc, title, 0, 0, x, 0, title_attributes.width, title_attributes.height);
-
-                XSetForeground(display, gc, WhitePixel(display, screen)); // Set text color to white
-
-                // Draw the title
-
-                // Draw the version and other info
-                std::string text = "version " + VERSION;
-                text += "\n\nPID: " + std::to_string(myPid);
-                text += "\nErrors: " + lastQbusError;
-                text += "\n\nPress CTRL + D to close this window.";
-
-                std::istringstream iss(text);
-                std::string line;
-                while (std::getline(iss, line))
+                active = !active;
+                history.append(active ? HistoryEvent::Resume : HistoryEvent::Pause, std::time(nullptr));
+                if (active)
                 {
-                    XDrawString(display, win, gc, x, y, line.c_str(), line.length());
-                    y += line_height; // Move down for the next line
+                    // Resuming makes the keep-awake call right away.
+                    logMessage(LogLevel::Info, "Hotkey resumed keep-awake, %lld us from key event to keep-awake call",
+                               static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - keyTime).count()));
+                    keepAwakeTick(history, status);
+                    nextTick = std::chrono::steady_clock::now() + interval;
                 }
-            }
-            if (ev.type == KeyPress)
-            {
-                if (ev.xkey.keycode == XKeysymToKeycode(display, XK_d) && (ev.xkey.state & ControlMask))
+                else
                 {
-                    break;
+                    logMessage(LogLevel::Info, "Hotkey paused keep-awake, %lld us from key event to pause",
+                               static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - keyTime).count()));
                 }
+                osd.show(active);
+                status.active = active;
+                control.setStatus(status);
+            }
+
+            if (display != NULL && displayLost)
+            {
+                logMessage(LogLevel::Warning, "Lost connection to the X server, hotkey %s is disabled", options.hotkey.c_str());
+                hotkey.ungrab();
+                osd.destroy();
+                XCloseDisplay(display);
+                display = NULL;
             }
         }
 
-        XDestroyImage(banner);
-        XDestroyImage(title);
-        XFreePixmap(display, banner_pixmap);
-        XFreePixmap(display, title_pixmap);
-        XDestroyWindow(display, win);
-        XCloseDisplay(display);
+        if (display != NULL)
+        {
+            hotkey.ungrab();
+            osd.destroy();
+            XCloseDisplay(display);
+        }
+        control.close();
+        close(signalFd);
+        stopLogger();
     }
 
 } // namespace caffeine8
@@ -196,6 +321,12 @@ int main(int argc, char *argv[])
 {
     pid_t existingPid;
 
+    caffeine8::DaemonOptions daemonOptions;
+    if (getenv("CAFFEINE8_HOTKEY") != NULL)
+    {
+        daemonOptions.hotkey = getenv("CAFFEINE8_HOTKEY");
+    }
+
     if (argc > 1)
     {
         std::string arg = argv[1];
@@ -213,8 +344,48 @@ int main(int argc, char *argv[])
             }
             return 0;
         }
-        else if (arg == "attach")
+        else if (arg == "attach" || arg == "tray")
         {
+            // Options are checked before a daemon is started, so a typo does
+            // not leave one keeping the machine awake.
+            if (arg == "tray" && argc > 2)
+            {
+                std::cerr << "Invalid tray option '" << argv[2] << "'. 'tray' takes no options." << std::endl;
+                return 1;
+            }
+            caffeine8::UIOptions options;
+            bool tui = false;
+            for (int i = 2; i < argc; ++i)
+            {
+                std::string option = argv[i];
+                if (option == "--perf-overlay")
+                {
+                    options.perfOverlay = true;
+                }
+                else if (option == "--record" && i + 1 < argc)
+                {
+                    options.recordPath = argv[++i];
+                }
+                else if (option == "--tui")
+                {
+                    tui = true;
+                }
+                else if (option == "--no-animation")
+                {
+                    options.animate = false;
+                }
+                else if (option == "--animation-benchmark" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+                {
+                    options.animationBenchmarkSeconds = atoi(argv[++i]);
+                }
+                else
+                {
+                    std::cerr << "Invalid attach option '" << option << "'. Use '--perf-overlay', '--record <file>', '--no-animation', "
+                              << "'--animation-benchmark <seconds>' or '--tui'." << std::endl;
+                    return 1;
+                }
+            }
+
             if (!caffeine8::checkExistingInstance(existingPid))
             {
                 std::cout << "Warning: caffeine8 is not running. Starting it now." << std::endl;
@@ -225,23 +396,91 @@ int main(int argc, char *argv[])
                 }
                 else if (pid == 0)
                 {
-                    while (true)
-                    {
-                        system("qdbus org.freedesktop.ScreenSaver /ScreenSaver SimulateUserActivity > /dev/null");
-                        sleep(60);
-                    }
+                    caffeine8::runDaemon(daemonOptions);
+                    return 0;
                 }
             }
+            if (arg == "tray")
+            {
+                // The tray only draws a few small icons, so it skips the image library entirely.
+                caffeine8::startLogger();
+                caffeine8::showTray();
+                caffeine8::stopLogger();
+                return 0;
+            }
+            if (tui)
+            {
+                caffeine8::showTui();
+                return 0;
+            }
+            caffeine8::startLogger();
             Magick::InitializeMagick(NULL);
-            caffeine8::showUI();
+            caffeine8::showUI(options);
+            caffeine8::stopLogger();
             return 0;
         }
+        else if (arg == "replay")
+        {
+            caffeine8::UIOptions options;
+            for (int i = 2; i < argc; ++i)
+            {
+                std::string option = argv[i];
+                if (option == "--fast")
+                {
+                    options.replayFast = true;
+                }
+                else if (option == "--perf-overlay")
+                {
+                    options.perfOverlay = true;
+                }
+                else if (options.replayPath.empty() && option[0] != '-')
+                {
+                    options.replayPath = option;
+                }
+                else
+                {
+                    options.replayPath.clear();
+                    break;
+                }
+            }
+            if (options.replayPath.empty())
+            {
+                std::cerr << "Usage: caffeine8 replay <file> [--fast] [--perf-overlay]" << std::endl;
+                return 1;
+            }
+            caffeine8::startLogger();
+            Magick::InitializeMagick(NULL);
+            caffeine8::showUI(options);
+            caffeine8::stopLogger();
+            return 0;
+        }
+        else if (arg == "history")
+        {
+            return caffeine8::runHistoryCommand(argc - 2, argv + 2);
+        }
         else if (arg == "start")
         {
+            for (int i = 2; i < argc; ++i)
+            {
+                std::string option = argv[i];
+                if (option == "--hotkey" && i + 1 < argc)
+                {
+                    daemonOptions.hotkey = argv[++i];
+                }
+                else if (option == "--osd")
+                {
+                    daemonOptions.hotkeyOsd = true;
+                }
+                else
+                {
+                    std::cerr << "Invalid start option '" << option << "'. Use '--hotkey <keys>' or '--osd'." << std::endl;
+                    return 1;
+                }
+            }
         }
         else
         {
-            std::cerr << "Invalid argument. Use 'start', 'stop', 'attach', or 'detach'." << std::endl;
+            std::cerr << "Invalid argument. Use 'start', 'stop', 'attach', 'tray', 'replay', 'history', or 'detach'." << std::endl;
             return 1;
         }
     }
@@ -269,31 +508,7 @@ int main(int argc, char *argv[])
 
     if (pid == 0)
     {
-        while (true)
-        {
-            std::string errorOutput;
-            FILE *fp = popen("qdbus org.freedesktop.ScreenSaver /ScreenSaver SimulateUserActivity 2>&1", "r");
-            if (fp == NULL)
-            {
-                caffeine8::lastQbusError = "Failed to run qdbus command";
-            }
-            else
-            {
-                char buffer[128];
-                while (fgets(buffer, sizeof(buffer), fp) != NULL)
-                {
-                    errorOutput += buffer;
-                }
-                pclose(fp);
-                if (!errorOutput.empty())
-                {
-                    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-                    caffeine8::lastQbusError = std::ctime(&now);
-                    caffeine8::lastQbusError += ": " + errorOutput;
-                }
-            }
-            sleep(60);
-        }
+        caffeine8::runDaemon(daemonOptions);
     }
 
     return 0;
@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "caffeine8.h"
+#include "control.h"
+#include "log.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        /// Longest message accepted from a client.
+        const size_t maxMessageLength = 4096;
+
+        /// Asset memfds kept by the daemon, one per pixel format.
+        const size_t maxStoredAssets = 4;
+
+        /// Largest asset memfd accepted from a client.
+        const off_t maxAssetSize = 64 * 1024 * 1024;
+
+        const int requiredSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+        bool makeAddress(const std::string &path, struct sockaddr_un &addr)
+        {
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path))
+            {
+                return false;
+            }
+            path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+            return true;
+        }
+    } // namespace
+
+    std::string controlSocketPath()
+    {
+        const std::string suffix = ".pid";
+        if (pidFilePath.size() > suffix.size() && pidFilePath.compare(pidFilePath.size() - suffix.size(), suffix.size(), suffix) == 0)
+        {
+            return pidFilePath.substr(0, pidFilePath.size() - suffix.size()) + ".sock";
+        }
+        return pidFilePath + ".sock";
+    }
+
+    std::string formatStatus(const DaemonStatus &status)
+    {
+        std::ostringstream out;
+        out << "STATE " << (!status.active ? "paused" : status.failing ? "error" : "active") << ' ' << status.pid << ' '
+            << (status.version.empty() ? "-" : status.version) << ' ' << status.ticks << ' ' << status.errors;
+        if (!status.last_error.empty())
+        {
+            out << ' ' << status.last_error.substr(0, status.last_error.find('\n'));
+        }
+        return out.str();
+    }
+
+    bool parseStatus(const std::string &line, DaemonStatus &status)
+    {
+        std::istringstream in(line);
+        std::string command;
+        std::string state;
+        long pid = 0;
+        if (!(in >> command >> state >> pid >> status.version >> status.ticks >> status.errors) || command != "STATE")
+        {
+            return false;
+        }
+        status.active = state != "paused";
+        status.failing = state == "error";
+        status.pid = static_cast<pid_t>(pid);
+        std::getline(in >> std::ws, status.last_error);
+        return true;
+    }
+
+    ControlConnection::~ControlConnection()
+    {
+        close();
+    }
+
+    ControlConnection::ControlConnection(ControlConnection &&other) noexcept
+        : fd_(other.fd_), input_(std::move(other.input_)), pendingFd_(other.pendingFd_), closed_(other.closed_)
+    {
+        other.fd_ = -1;
+        other.pendingFd_ = -1;
+    }
+
+    ControlConnection &ControlConnection::operator=(ControlConnection &&other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            fd_ = other.fd_;
+            input_ = std::move(other.input_);
+            pendingFd_ = other.pendingFd_;
+            closed_ = other.closed_;
+            other.fd_ = -1;
+            other.pendingFd_ = -1;
+        }
+        return *this;
+    }
+
+    bool ControlConnection::connect()
+    {
+        close();
+        closed_ = false;
+        struct sockaddr_un addr;
+        if (!makeAddress(controlSocketPath(), addr))
+        {
+            return false;
+        }
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0)
+        {
+            return false;
+        }
+        if (::connect(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool ControlConnection::subscribe()
+    {
+        if (!connect() || !send("SUBSCRIBE"))
+        {
+            close();
+            return false;
+        }
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
+
+    bool ControlConnection::send(const std::string &line, int passFd)
+    {
+        if (fd_ < 0)
+        {
+            return false;
+        }
+        std::string message = line + "\n";
+        struct iovec iov = {&message[0], message.size()};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        if (passFd >= 0)
+        {
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = sizeof(control.buffer);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+        }
+
+        // Messages are short; a partial write only happens on a full socket
+        // buffer, in which case the peer is not reading and is dropped.
+        ssize_t n;
+        while ((n = sendmsg(fd_, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        {
+        }
+        if (n != static_cast<ssize_t>(message.size()))
+        {
+            closed_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool ControlConnection::hasMessage() const
+    {
+        return input_.find('\n') != std::string::npos;
+    }
+
+    bool ControlConnection::receive(std::string &line, int &receivedFd)
+    {
+        receivedFd = -1;
+        while (!hasMessage() && fd_ >= 0 && !closed_)
+        {
+            char buffer[1024];
+            struct iovec iov = {buffer, sizeof(buffer)};
+            union
+            {
+                char buffer[CMSG_SPACE(sizeof(int))];
+                struct cmsghdr align;
+            } control;
+            struct msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = sizeof(control.buffer);
+
+            ssize_t n = recvmsg(fd_, &msg, MSG_CMSG_CLOEXEC);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return false;
+            }
+            if (n <= 0)
+            {
+                closed_ = true;
+                break;
+            }
+
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                {
+                    int fd;
+                    std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+                    if (pendingFd_ >= 0)
+                    {
+                        ::close(pendingFd_);
+                    }
+                    pendingFd_ = fd;
+                }
+            }
+            input_.append(buffer, n);
+            if (input_.size() > maxMessageLength && !hasMessage())
+            {
+                closed_ = true;
+                break;
+            }
+        }
+
+        size_t end = input_.find('\n');
+        if (end == std::string::npos)
+        {
+            return false;
+        }
+        line = input_.substr(0, end);
+        input_.erase(0, end + 1);
+        // A descriptor arrives with the first bytes of the message it belongs to.
+        receivedFd = pendingFd_;
+        pendingFd_ = -1;
+        return true;
+    }
+
+    bool ControlConnection::pollStatus(DaemonStatus &status)
+    {
+        std::string line;
+        int unused;
+        bool received = false;
+        while (receive(line, unused))
+        {
+            if (unused >= 0)
+            {
+                ::close(unused);
+            }
+            received = parseStatus(line, status) || received;
+        }
+        if (closed_)
+        {
+            close();
+        }
+        return received;
+    }
+
+    void ControlConnection::close()
+    {
+        if (pendingFd_ >= 0)
+        {
+            ::close(pendingFd_);
+            pendingFd_ = -1;
+        }
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        input_.clear();
+    }
+
+    const int StatusSubscription::reconnectIntervalMs;
+
+    void StatusSubscription::start()
+    {
+        known_ = false;
+        if (!connection_.subscribe())
+        {
+            retryAt_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(reconnectIntervalMs);
+        }
+    }
+
+    bool StatusSubscription::update(DaemonStatus &status)
+    {
+        if (!connected())
+        {
+            if (std::chrono::steady_clock::now() >= retryAt_)
+            {
+                start();
+            }
+            return false;
+        }
+        bool received = connection_.pollStatus(status);
+        known_ = known_ || received;
+        if (!connected())
+        {
+            known_ = false;
+            retryAt_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(reconnectIntervalMs);
+            return true;
+        }
+        return received;
+    }
+
+    int StatusSubscription::timeoutMs() const
+    {
+        if (connected())
+        {
+            return -1;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(retryAt_ - std::chrono::steady_clock::now()).count();
+        return static_cast<int>(std::max(0LL, static_cast<long long>(remaining) + 1));
+    }
+
+    ControlServer::~ControlServer()
+    {
+        close();
+    }
+
+    bool ControlServer::listen(const std::string &path)
+    {
+        struct sockaddr_un addr;
+        if (!makeAddress(path, addr))
+        {
+            return false;
+        }
+        listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (listenFd_ < 0)
+        {
+            return false;
+        }
+
+        // Only one daemon runs at a time (see HistoryLog::openForAppend), so
+        // a socket left at the path belongs to a daemon that has exited.
+        unlink(path.c_str());
+        if (bind(listenFd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(listenFd_, 16) != 0)
+        {
+            ::close(listenFd_);
+            listenFd_ = -1;
+            return false;
+        }
+        // Stored assets are handed to every client, so only the daemon's
+        // user may publish or fetch them.
+        chmod(path.c_str(), 0600);
+        struct stat st;
+        inode_ = stat(path.c_str(), &st) == 0 ? st.st_ino : 0;
+        path_ = path;
+        return true;
+    }
+
+    void ControlServer::close()
+    {
+        clients_.clear();
+        for (const auto &asset : assets_)
+        {
+            ::close(asset.second);
+        }
+        assets_.clear();
+        assetOrder_.clear();
+        if (listenFd_ >= 0)
+        {
+            ::close(listenFd_);
+            listenFd_ = -1;
+            // A daemon replacing this one may already have bound the path again.
+            struct stat st;
+            if (stat(path_.c_str(), &st) == 0 && st.st_ino == inode_)
+            {
+                unlink(path_.c_str());
+            }
+        }
+    }
+
+    void ControlServer::addPollFds(std::vector<struct pollfd> &fds) const
+    {
+        fds.push_back({listenFd_, POLLIN, 0});
+        for (const Client &client : clients_)
+        {
+            fds.push_back({client.connection.fd(), POLLIN, 0});
+        }
+    }
+
+    void ControlServer::handlePollFds(const struct pollfd *fds)
+    {
+        for (size_t i = 0; i < clients_.size(); ++i)
+        {
+            if (fds[i + 1].revents == 0)
+            {
+                continue;
+            }
+            std::string line;
+            int receivedFd;
+            while (clients_[i].connection.receive(line, receivedFd))
+            {
+                handleMessage(clients_[i], line, receivedFd);
+            }
+        }
+        clients_.erase(std::remove_if(clients_.begin(), clients_.end(), [](const Client &client)
+                                      { return client.connection.closed(); }),
+                       clients_.end());
+
+        if (fds[0].revents & POLLIN)
+        {
+            accept();
+        }
+    }
+
+    void ControlServer::accept()
+    {
+        while (true)
+        {
+            int fd = accept4(listenFd_, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd < 0)
+            {
+                return;
+            }
+            clients_.push_back({ControlConnection(fd), false});
+        }
+    }
+
+    void ControlServer::setStatus(const DaemonStatus &status)
+    {
+        std::string line = formatStatus(status);
+        if (line == status_)
+        {
+            return;
+        }
+        status_ = line;
+        // A subscriber that stopped reading fills its socket buffer and is dropped.
+        for (Client &client : clients_)
+        {
+            if (client.subscribed)
+            {
+                client.connection.send(status_);
+            }
+        }
+    }
+
+    void ControlServer::handleMessage(Client &client, const std::string &line, int receivedFd)
+    {
+        std::string command = line.substr(0, line.find(' '));
+        std::string argument = line.find(' ') == std::string::npos ? "" : line.substr(line.find(' ') + 1);
+
+        if (command == "GET-ASSETS")
+        {
+            auto it = assets_.find(argument);
+            if (it == assets_.end())
+            {
+                client.connection.send("NO-ASSETS");
+            }
+            else
+            {
+                client.connection.send("ASSETS", it->second);
+            }
+        }
+        else if (command == "PUT-ASSETS" && receivedFd >= 0)
+        {
+            client.connection.send(storeAssets(argument, receivedFd) ? "OK" : "ERROR assets rejected");
+            receivedFd = -1;
+        }
+        else if (command == "SUBSCRIBE")
+        {
+            client.subscribed = true;
+            client.connection.send(status_);
+        }
+        else
+        {
+            client.connection.send("ERROR unknown command");
+        }
+
+        if (receivedFd >= 0)
+        {
+            ::close(receivedFd);
+        }
+    }
+
+    bool ControlServer::storeAssets(const std::string &key, int fd)
+    {
+        // Every attach window maps the memfd, so it must be impossible to change afterwards.
+        int seals = fcntl(fd, F_GET_SEALS);
+        struct stat st;
+        if (key.empty() || seals < 0 || (seals & requiredSeals) != requiredSeals || fstat(fd, &st) != 0 || st.st_size > maxAssetSize)
+        {
+            logMessage(LogLevel::Warning, "Rejected shared assets for '%s': not a sealed memfd of acceptable size", key.c_str());
+            ::close(fd);
+            return false;
+        }
+
+        auto it = assets_.find(key);
+        if (it != assets_.end())
+        {
+            ::close(fd); // Another window published the same format first.
+            return true;
+        }
+        if (assets_.size() >= maxStoredAssets)
+        {
+            ::close(assets_[assetOrder_.front()]);
+            assets_.erase(assetOrder_.front());
+            assetOrder_.pop_front();
+        }
+        assets_[key] = fd;
+        assetOrder_.push_back(key);
+        logMessage(LogLevel::Info, "Sharing decoded assets for '%s' (%lld bytes)", key.c_str(), static_cast<long long>(st.st_size));
+        return true;
+    }
+
+} // namespace caffeine8
@@ -0,0 +1,883 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "history.h"
+
+namespace caffeine8
+{
+    const uint64_t historyIndexStride = 256;
+    const uint64_t historyCompactThreshold = 8192;
+
+    namespace
+    {
+        /// How long openForAppend() waits for another writer to release the lock.
+        const int lockWaitMs = 10000;
+        const int lockRetryMs = 100;
+
+        // Files are grown in steps of this size to keep remapping rare.
+        const size_t mapGrowth = 64 * 1024;
+
+        const char logMagic[8] = {'C', '8', 'H', 'L', 'O', 'G', '0', '1'};
+        const char indexMagic[8] = {'C', '8', 'H', 'I', 'D', 'X', '0', '1'};
+        const char daysMagic[8] = {'C', '8', 'H', 'D', 'A', 'Y', '0', '1'};
+
+        /// Header of history.log; the records follow it.
+        struct LogHeader
+        {
+            char magic[8];
+            uint64_t count;   // Published with release semantics after the record is written.
+            int64_t lastMark; // Time up to which the open session has been added to the day totals.
+            uint32_t active;  // Non-zero while a session is open.
+            uint32_t reserved;
+            uint64_t compactedCount; // Records left by the last compaction.
+            uint64_t unused[3];
+        };
+
+        /// Header of history.idx and history.days; the entries follow it.
+        struct TableHeader
+        {
+            char magic[8];
+            uint64_t count;
+        };
+
+        struct IndexEntry
+        {
+            int64_t time;
+            uint64_t record;
+        };
+
+        static_assert(sizeof(LogHeader) == 64, "LogHeader layout changed");
+        static_assert(sizeof(HistoryRecord) == 64, "HistoryRecord layout changed");
+
+        LogHeader *logHeader(const MappedFile &file)
+        {
+            return reinterpret_cast<LogHeader *>(file.data());
+        }
+
+        HistoryRecord *logRecords(const MappedFile &file)
+        {
+            return reinterpret_cast<HistoryRecord *>(file.data() + sizeof(LogHeader));
+        }
+
+        TableHeader *tableHeader(const MappedFile &file)
+        {
+            return reinterpret_cast<TableHeader *>(file.data());
+        }
+
+        template <typename T>
+        T *tableEntries(const MappedFile &file)
+        {
+            return reinterpret_cast<T *>(file.data() + sizeof(TableHeader));
+        }
+
+        /// Returns the number of entries a reader may look at, bounded by the mapped size.
+        uint64_t publishedCount(const uint64_t *count, size_t mapped, size_t header, size_t entry)
+        {
+            uint64_t n = __atomic_load_n(count, __ATOMIC_ACQUIRE);
+            uint64_t fits = mapped < header ? 0 : (mapped - header) / entry;
+            return std::min(n, fits);
+        }
+
+        uint64_t tableCount(const MappedFile &file, size_t entry)
+        {
+            if (file.size() < sizeof(TableHeader))
+            {
+                return 0;
+            }
+            return publishedCount(&tableHeader(file)->count, file.size(), sizeof(TableHeader), entry);
+        }
+
+        bool initFile(MappedFile &file, const char *magic, size_t headerSize)
+        {
+            if (file.size() < headerSize)
+            {
+                if (!file.reserve(headerSize))
+                {
+                    return false;
+                }
+                std::memcpy(file.data(), magic, 8);
+            }
+            return std::memcmp(file.data(), magic, 8) == 0;
+        }
+
+        bool checkFile(const MappedFile &file, const char *magic, size_t headerSize)
+        {
+            return file.size() >= headerSize && std::memcmp(file.data(), magic, 8) == 0;
+        }
+
+        /// Returns whether the entry count in a file's header fits in the file.
+        bool countFits(const MappedFile &file, size_t headerSize, size_t entrySize)
+        {
+            uint64_t count = *reinterpret_cast<const uint64_t *>(file.data() + 8);
+            return count <= (file.size() - headerSize) / entrySize;
+        }
+
+        /**
+         * Opens a history file for writing. A file that is not ours or whose
+         * header is damaged is moved aside to <path>.bad and started afresh,
+         * so the daemon never writes through a header it cannot trust.
+         */
+        bool openWritable(MappedFile &file, const std::string &path, const char *magic, size_t headerSize, size_t entrySize)
+        {
+            if (file.open(path, true) && initFile(file, magic, headerSize) && countFits(file, headerSize, entrySize))
+            {
+                return true;
+            }
+            file.close();
+            if (::rename(path.c_str(), (path + ".bad").c_str()) != 0 && errno != ENOENT)
+            {
+                return false;
+            }
+            if (file.open(path, true) && initFile(file, magic, headerSize))
+            {
+                return true;
+            }
+            file.close();
+            return false;
+        }
+
+        /// Writes a file next to its final path and renames it into place.
+        bool replaceFile(const std::string &path, const std::string &contents)
+        {
+            std::string tmpPath = path + ".tmp";
+            int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                return false;
+            }
+            size_t written = 0;
+            while (written < contents.size())
+            {
+                ssize_t n = ::write(fd, contents.data() + written, contents.size() - written);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    ::close(fd);
+                    ::unlink(tmpPath.c_str());
+                    return false;
+                }
+                written += n;
+            }
+            bool ok = ::fsync(fd) == 0;
+            ok = ::close(fd) == 0 && ok;
+            if (!ok || ::rename(tmpPath.c_str(), path.c_str()) != 0)
+            {
+                ::unlink(tmpPath.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        int64_t localDayStart(int64_t time)
+        {
+            time_t t = time;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+            tm.tm_sec = 0;
+            tm.tm_isdst = -1;
+            return mktime(&tm);
+        }
+
+        int64_t nextDayStart(int64_t day)
+        {
+            time_t t = day;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            tm.tm_mday += 1;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+            tm.tm_sec = 0;
+            tm.tm_isdst = -1;
+            return mktime(&tm);
+        }
+
+        bool makeDirectories(const std::string &path)
+        {
+            for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
+            {
+                std::string part = path.substr(0, pos);
+                if (::mkdir(part.c_str(), 0700) != 0 && errno != EEXIST)
+                {
+                    return false;
+                }
+                if (pos == std::string::npos)
+                {
+                    return true;
+                }
+            }
+        }
+
+        std::string formatTime(int64_t time, const char *format)
+        {
+            time_t t = time;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            char buffer[64];
+            strftime(buffer, sizeof(buffer), format, &tm);
+            return buffer;
+        }
+
+        std::string formatDuration(int64_t seconds)
+        {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%lldh %02lldm", static_cast<long long>(seconds / 3600), static_cast<long long>(seconds % 3600 / 60));
+            return buffer;
+        }
+
+        const char *eventName(uint32_t type)
+        {
+            switch (static_cast<HistoryEvent>(type))
+            {
+            case HistoryEvent::Start:
+                return "start";
+            case HistoryEvent::Stop:
+                return "stop";
+            case HistoryEvent::Tick:
+                return "tick";
+            case HistoryEvent::Error:
+                return "error";
+            case HistoryEvent::Pause:
+                return "pause";
+            case HistoryEvent::Resume:
+                return "resume";
+            }
+            return "unknown";
+        }
+
+        /// Parses "30d", "12h", "45m", "90s", "2w" relative to now, or an absolute YYYY-MM-DD date.
+        bool parseSince(const std::string &value, int64_t now, int64_t &since)
+        {
+            struct tm tm = {};
+            const char *end = strptime(value.c_str(), "%Y-%m-%d", &tm);
+            if (end != nullptr && *end == '\0')
+            {
+                tm.tm_isdst = -1;
+                since = mktime(&tm);
+                return true;
+            }
+
+            char *unit = nullptr;
+            long long amount = strtoll(value.c_str(), &unit, 10);
+            if (unit == value.c_str() || amount < 0 || std::strlen(unit) != 1)
+            {
+                return false;
+            }
+            switch (*unit)
+            {
+            case 's':
+                since = now - amount;
+                return true;
+            case 'm':
+                since = now - amount * 60;
+                return true;
+            case 'h':
+                since = now - amount * 3600;
+                return true;
+            case 'd':
+                since = now - amount * 86400;
+                return true;
+            case 'w':
+                since = now - amount * 7 * 86400;
+                return true;
+            }
+            return false;
+        }
+    } // namespace
+
+    MappedFile::~MappedFile()
+    {
+        close();
+    }
+
+    bool MappedFile::open(const std::string &path, bool writable)
+    {
+        close();
+        path_ = path;
+        fd_ = ::open(path.c_str(), writable ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC), 0644);
+        if (fd_ < 0)
+        {
+            return false;
+        }
+        writable_ = writable;
+
+        struct stat st;
+        if (fstat(fd_, &st) != 0)
+        {
+            close();
+            return false;
+        }
+        if (st.st_size > 0)
+        {
+            void *data = mmap(nullptr, st.st_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd_, 0);
+            if (data == MAP_FAILED)
+            {
+                close();
+                return false;
+            }
+            data_ = static_cast<char *>(data);
+            size_ = st.st_size;
+        }
+        return true;
+    }
+
+    bool MappedFile::reserve(size_t bytes)
+    {
+        if (bytes <= size_)
+        {
+            return true;
+        }
+        if (!writable_)
+        {
+            return false;
+        }
+
+        size_t newSize = (bytes + mapGrowth - 1) / mapGrowth * mapGrowth;
+        if (ftruncate(fd_, newSize) != 0)
+        {
+            return false;
+        }
+        void *data = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (data == MAP_FAILED)
+        {
+            return false;
+        }
+        if (data_ != nullptr)
+        {
+            munmap(data_, size_);
+        }
+        data_ = static_cast<char *>(data);
+        size_ = newSize;
+        return true;
+    }
+
+    bool MappedFile::changed() const
+    {
+        struct stat onDisk;
+        struct stat mapped;
+        if (fd_ < 0 || ::stat(path_.c_str(), &onDisk) != 0 || fstat(fd_, &mapped) != 0)
+        {
+            return true;
+        }
+        return onDisk.st_ino != mapped.st_ino || onDisk.st_dev != mapped.st_dev || static_cast<size_t>(onDisk.st_size) != size_;
+    }
+
+    void MappedFile::close()
+    {
+        if (data_ != nullptr)
+        {
+            munmap(data_, size_);
+            data_ = nullptr;
+        }
+        size_ = 0;
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    bool HistoryLog::openForAppend(const std::string &dir, long tickIntervalMs, int cancelFd)
+    {
+        if (!makeDirectories(dir))
+        {
+            return false;
+        }
+        dir_ = dir;
+        // Record times have a resolution of one second, so allow at least that
+        // much jitter on top of two intervals.
+        maxGap_ = std::max<int64_t>(2, (2 * static_cast<int64_t>(tickIntervalMs) + 999) / 1000 + 1);
+
+        // The lock is held for the lifetime of the writer so that a daemon
+        // being replaced finishes its last records before the next one starts.
+        lockFd_ = ::open((dir_ + "/history.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lockFd_ < 0)
+        {
+            return false;
+        }
+        // A daemon being replaced releases it within moments; a writer that
+        // keeps it is another daemon, which this one must not wait on forever.
+        auto giveUpAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(lockWaitMs);
+        while (flock(lockFd_, LOCK_EX | LOCK_NB) != 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EWOULDBLOCK || std::chrono::steady_clock::now() >= giveUpAt)
+            {
+                int error = errno;
+                close();
+                errno = error;
+                return false;
+            }
+            struct pollfd cancel = {cancelFd, POLLIN, 0};
+            if (poll(&cancel, 1, lockRetryMs) > 0 && (cancel.revents & POLLIN))
+            {
+                close();
+                errno = ECANCELED;
+                return false;
+            }
+        }
+
+        if (!openFiles(true))
+        {
+            close();
+            return false;
+        }
+
+        uint64_t count = logHeader(log_)->count;
+        if (tableHeader(index_)->count != (count + historyIndexStride - 1) / historyIndexStride && !rebuildIndex())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    HistoryLog::~HistoryLog()
+    {
+        close();
+    }
+
+    void HistoryLog::close()
+    {
+        log_.close();
+        index_.close();
+        days_.close();
+        if (lockFd_ >= 0)
+        {
+            ::close(lockFd_);
+            lockFd_ = -1;
+        }
+    }
+
+    bool HistoryLog::writable() const
+    {
+        return lockFd_ >= 0 && log_.isOpen() && index_.isOpen() && days_.isOpen();
+    }
+
+    bool HistoryLog::openReadOnly(const std::string &dir)
+    {
+        dir_ = dir;
+        return openFiles(false);
+    }
+
+    bool HistoryLog::openFiles(bool writable)
+    {
+        if (writable)
+        {
+            return openWritable(log_, dir_ + "/history.log", logMagic, sizeof(LogHeader), sizeof(HistoryRecord)) &&
+                   openWritable(index_, dir_ + "/history.idx", indexMagic, sizeof(TableHeader), sizeof(IndexEntry)) &&
+                   openWritable(days_, dir_ + "/history.days", daysMagic, sizeof(TableHeader), sizeof(DayTotal));
+        }
+        if (!log_.open(dir_ + "/history.log", false) ||
+            !index_.open(dir_ + "/history.idx", false) ||
+            !days_.open(dir_ + "/history.days", false))
+        {
+            return false;
+        }
+        return checkFile(log_, logMagic, sizeof(LogHeader)) &&
+               checkFile(index_, indexMagic, sizeof(TableHeader)) &&
+               checkFile(days_, daysMagic, sizeof(TableHeader));
+    }
+
+    bool HistoryLog::refresh()
+    {
+        if (log_.changed() || index_.changed() || days_.changed())
+        {
+            return openFiles(false);
+        }
+        return true;
+    }
+
+    uint64_t HistoryLog::recordCount() const
+    {
+        if (log_.size() < sizeof(LogHeader))
+        {
+            return 0;
+        }
+        return publishedCount(&logHeader(log_)->count, log_.size(), sizeof(LogHeader), sizeof(HistoryRecord));
+    }
+
+    bool HistoryLog::append(HistoryEvent type, int64_t time, uint32_t aux, const std::string &text)
+    {
+        if (!writable())
+        {
+            return false;
+        }
+
+        uint64_t n = logHeader(log_)->count;
+        if (!log_.reserve(sizeof(LogHeader) + (n + 1) * sizeof(HistoryRecord)))
+        {
+            return false;
+        }
+
+        HistoryRecord &record = logRecords(log_)[n];
+        std::memset(&record, 0, sizeof(record));
+        record.time = time;
+        record.type = static_cast<uint32_t>(type);
+        record.aux = aux;
+        text.copy(record.text, sizeof(record.text) - 1);
+        __atomic_store_n(&logHeader(log_)->count, n + 1, __ATOMIC_RELEASE);
+
+        if (n % historyIndexStride == 0)
+        {
+            uint64_t entries = tableHeader(index_)->count;
+            if (!index_.reserve(sizeof(TableHeader) + (entries + 1) * sizeof(IndexEntry)))
+            {
+                return false;
+            }
+            tableEntries<IndexEntry>(index_)[entries] = {time, n};
+            __atomic_store_n(&tableHeader(index_)->count, entries + 1, __ATOMIC_RELEASE);
+        }
+
+        LogHeader *header = logHeader(log_);
+        DayTotal *total = nullptr;
+        switch (type)
+        {
+        case HistoryEvent::Start:
+            // A session that was still open ended without a Stop record; its
+            // time has already been counted up to its last tick.
+            header->active = 1;
+            header->lastMark = time;
+            if ((total = dayTotal(localDayStart(time))) == nullptr)
+            {
+                return false;
+            }
+            total->sessions++;
+            break;
+        case HistoryEvent::Resume:
+            header->active = 1;
+            header->lastMark = time;
+            break;
+        case HistoryEvent::Tick:
+        case HistoryEvent::Stop:
+        case HistoryEvent::Pause:
+            if (header->active)
+            {
+                // A longer silence means the machine was suspended or the clock
+                // jumped: the session ended at its last mark, like one left
+                // without a Stop record, and a Tick starts counting afresh.
+                if (time - header->lastMark <= maxGap_ && !addActive(header->lastMark, time))
+                {
+                    return false;
+                }
+                header = logHeader(log_);
+                header->lastMark = std::max(header->lastMark, time);
+                header->active = type == HistoryEvent::Tick;
+            }
+            break;
+        case HistoryEvent::Error:
+            if ((total = dayTotal(localDayStart(time))) == nullptr)
+            {
+                return false;
+            }
+            total->errors++;
+            break;
+        }
+
+        // Compaction only drops Ticks, so the trigger grows with what the last
+        // one left behind; otherwise enough Error records alone would make
+        // every append rewrite the whole log.
+        if (n + 1 >= std::max(historyCompactThreshold, 2 * header->compactedCount))
+        {
+            return compact();
+        }
+        return true;
+    }
+
+    bool HistoryLog::addActive(int64_t from, int64_t to)
+    {
+        while (from < to)
+        {
+            int64_t day = localDayStart(from);
+            int64_t end = std::min(to, nextDayStart(day));
+            DayTotal *total = dayTotal(day);
+            if (total == nullptr)
+            {
+                return false;
+            }
+            total->activeSeconds += end - from;
+            from = end;
+        }
+        return true;
+    }
+
+    DayTotal *HistoryLog::dayTotal(int64_t day)
+    {
+        uint64_t count = tableHeader(days_)->count;
+        DayTotal *begin = tableEntries<DayTotal>(days_);
+        DayTotal *it = std::lower_bound(begin, begin + count, day, [](const DayTotal &total, int64_t d)
+                                        { return total.day < d; });
+        if (it != begin + count && it->day == day)
+        {
+            return it;
+        }
+
+        // Days are normally appended in order; inserting before the end only
+        // happens when the clock went backwards.
+        uint64_t pos = it - begin;
+        if (!days_.reserve(sizeof(TableHeader) + (count + 1) * sizeof(DayTotal)))
+        {
+            return nullptr;
+        }
+        begin = tableEntries<DayTotal>(days_);
+        std::memmove(begin + pos + 1, begin + pos, (count - pos) * sizeof(DayTotal));
+        begin[pos] = {day, 0, 0, 0};
+        __atomic_store_n(&tableHeader(days_)->count, count + 1, __ATOMIC_RELEASE);
+        return begin + pos;
+    }
+
+    bool HistoryLog::rebuildIndex()
+    {
+        uint64_t count = logHeader(log_)->count;
+        const HistoryRecord *records = logRecords(log_);
+
+        TableHeader header = {};
+        std::memcpy(header.magic, indexMagic, sizeof(header.magic));
+        std::string contents(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (uint64_t i = 0; i < count; i += historyIndexStride)
+        {
+            IndexEntry entry = {records[i].time, i};
+            contents.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+            header.count++;
+        }
+        std::memcpy(&contents[0], &header, sizeof(header));
+
+        std::string path = dir_ + "/history.idx";
+        return replaceFile(path, contents) && index_.open(path, true);
+    }
+
+    bool HistoryLog::compact()
+    {
+        if (!writable())
+        {
+            return false;
+        }
+
+        uint64_t count = logHeader(log_)->count;
+        const HistoryRecord *records = logRecords(log_);
+
+        // Walk backwards and keep only the last Tick of each session that has
+        // no Stop record, since it is the only evidence of when that session ended.
+        std::vector<bool> keep(count, true);
+        bool keepTick = true;
+        for (uint64_t i = count; i-- > 0;)
+        {
+            switch (static_cast<HistoryEvent>(records[i].type))
+            {
+            case HistoryEvent::Start:
+                keepTick = true;
+                break;
+            case HistoryEvent::Stop:
+            case HistoryEvent::Pause:
+                keepTick = false;
+                break;
+            case HistoryEvent::Tick:
+                keep[i] = keepTick;
+                keepTick = false;
+                break;
+            case HistoryEvent::Error:
+            case HistoryEvent::Resume:
+                break;
+            }
+        }
+
+        LogHeader header = *logHeader(log_);
+        header.count = 0;
+        std::string contents(sizeof(header), '\0');
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            if (keep[i])
+            {
+                contents.append(reinterpret_cast<const char *>(&records[i]), sizeof(HistoryRecord));
+                header.count++;
+            }
+        }
+        header.compactedCount = header.count;
+        std::memcpy(&contents[0], &header, sizeof(header));
+
+        std::string path = dir_ + "/history.log";
+        if (!replaceFile(path, contents) || !log_.open(path, true))
+        {
+            return false;
+        }
+        return rebuildIndex();
+    }
+
+    std::vector<HistoryRecord> HistoryLog::recordsSince(int64_t since) const
+    {
+        std::vector<HistoryRecord> result;
+        uint64_t count = recordCount();
+        const HistoryRecord *records = logRecords(log_);
+
+        // Start scanning at the last indexed record before 'since'.
+        uint64_t entries = tableCount(index_, sizeof(IndexEntry));
+        const IndexEntry *index = tableEntries<IndexEntry>(index_);
+        const IndexEntry *it = std::lower_bound(index, index + entries, since, [](const IndexEntry &entry, int64_t t)
+                                                { return entry.time < t; });
+        uint64_t start = it == index ? 0 : std::min((it - 1)->record, count);
+
+        for (uint64_t i = start; i < count; ++i)
+        {
+            if (records[i].time >= since)
+            {
+                result.push_back(records[i]);
+            }
+        }
+        return result;
+    }
+
+    bool HistoryLog::lastRecord(HistoryEvent type, HistoryRecord &record) const
+    {
+        const HistoryRecord *records = logRecords(log_);
+        for (uint64_t i = recordCount(); i-- > 0;)
+        {
+            if (records[i].type == static_cast<uint32_t>(type))
+            {
+                record = records[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<DayTotal> HistoryLog::dayTotalsSince(int64_t since) const
+    {
+        uint64_t count = tableCount(days_, sizeof(DayTotal));
+        const DayTotal *begin = tableEntries<DayTotal>(days_);
+        int64_t day = localDayStart(since);
+        const DayTotal *it = std::lower_bound(begin, begin + count, day, [](const DayTotal &total, int64_t d)
+                                              { return total.day < d; });
+        return std::vector<DayTotal>(it, begin + count);
+    }
+
+    std::string historyDirPath()
+    {
+        const char *stateHome = getenv("XDG_STATE_HOME");
+        if (stateHome != nullptr && stateHome[0] == '/')
+        {
+            return std::string(stateHome) + "/caffeine8";
+        }
+        const char *home = getenv("HOME");
+        return std::string(home != nullptr ? home : "/tmp") + "/.local/state/caffeine8";
+    }
+
+    int runHistoryCommand(int argc, char *argv[])
+    {
+        int64_t now = std::time(nullptr);
+        int64_t since = now - 30 * 86400;
+        bool summary = false;
+
+        for (int i = 0; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "--summary")
+            {
+                summary = true;
+            }
+            else if (arg == "--since" && i + 1 < argc)
+            {
+                if (!parseSince(argv[++i], now, since))
+                {
+                    std::cerr << "Invalid --since value '" << argv[i] << "'. Use e.g. 30d, 12h or 2023-01-31." << std::endl;
+                    return 1;
+                }
+            }
+            else
+            {
+                std::cerr << "Usage: caffeine8 history [--since <30d|12h|YYYY-MM-DD>] [--summary]" << std::endl;
+                return 1;
+            }
+        }
+
+        HistoryLog log;
+        if (!log.openReadOnly(historyDirPath()))
+        {
+            std::cout << "No history recorded yet." << std::endl;
+            return 0;
+        }
+
+        if (summary)
+        {
+            int64_t totalSeconds = 0;
+            uint64_t totalSessions = 0;
+            uint64_t totalErrors = 0;
+            std::cout << std::left << std::setw(12) << "Day" << std::setw(12) << "Active" << std::setw(10) << "Sessions" << "Errors" << std::endl;
+            for (const DayTotal &total : log.dayTotalsSince(since))
+            {
+                std::cout << std::setw(12) << formatTime(total.day, "%Y-%m-%d") << std::setw(12) << formatDuration(total.activeSeconds)
+                          << std::setw(10) << total.sessions << total.errors << std::endl;
+                totalSeconds += total.activeSeconds;
+                totalSessions += total.sessions;
+                totalErrors += total.errors;
+            }
+            std::cout << std::setw(12) << "Total" << std::setw(12) << formatDuration(totalSeconds)
+                      << std::setw(10) << totalSessions << totalErrors << std::endl;
+            return 0;
+        }
+
+        bool open = false;
+        int64_t lastSeen = 0;
+        for (const HistoryRecord &record : log.recordsSince(since))
+        {
+            HistoryEvent type = static_cast<HistoryEvent>(record.type);
+            if (type == HistoryEvent::Tick)
+            {
+                lastSeen = record.time;
+                continue;
+            }
+            if (type == HistoryEvent::Start && open && lastSeen != 0)
+            {
+                std::cout << formatTime(lastSeen, "%Y-%m-%d %H:%M:%S") << "  stop (last seen, no stop recorded)" << std::endl;
+            }
+            if (type == HistoryEvent::Start || type == HistoryEvent::Stop)
+            {
+                open = type == HistoryEvent::Start;
+                lastSeen = 0;
+            }
+            std::cout << formatTime(record.time, "%Y-%m-%d %H:%M:%S") << "  " << eventName(record.type);
+            if (record.text[0] != '\0')
+            {
+                std::cout << "  " << record.text;
+            }
+            std::cout << std::endl;
+        }
+        return 0;
+    }
+
+} // namespace caffeine8
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+#include <X11/XKBlib.h>
+#include <X11/Xutil.h>
+#include "assets.h"
+#include "hotkey.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        const int osdWidth = 240;
+        const int osdHeight = 44;
+        const std::chrono::milliseconds osdTimeout(1500);
+
+        /// Lock modifiers the grab has to be repeated for.
+        const unsigned int ignoredModifiers[] = {0, LockMask, Mod2Mask, LockMask | Mod2Mask};
+
+        bool grabFailed = false;
+
+        int recordGrabError(Display *, XErrorEvent *error)
+        {
+            if (error->error_code == BadAccess)
+            {
+                grabFailed = true;
+            }
+            return 0;
+        }
+
+        Pixmap renderMessage(Display *display, Window win, GC gc, const char *text, unsigned long accent)
+        {
+            int screen = DefaultScreen(display);
+            Pixmap pixmap = XCreatePixmap(display, win, osdWidth, osdHeight, DefaultDepth(display, screen));
+            XSetForeground(display, gc, BlackPixel(display, screen));
+            XFillRectangle(display, pixmap, gc, 0, 0, osdWidth, osdHeight);
+            XSetForeground(display, gc, accent);
+            XFillRectangle(display, pixmap, gc, 0, 0, 8, osdHeight);
+            XSetForeground(display, gc, WhitePixel(display, screen));
+            XDrawRectangle(display, pixmap, gc, 0, 0, osdWidth - 1, osdHeight - 1);
+            XDrawString(display, pixmap, gc, 24, osdHeight / 2 + 5, text, strlen(text));
+            return pixmap;
+        }
+    } // namespace
+
+    bool Hotkey::grab(Display *display, const std::string &spec)
+    {
+        unsigned int modifiers = 0;
+        size_t start = 0;
+        while (true)
+        {
+            size_t end = spec.find('+', start);
+            std::string part = spec.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            if (end == std::string::npos)
+            {
+                KeySym keysym = XStringToKeysym(part.c_str());
+                if (keysym == NoSymbol && part.size() == 1)
+                {
+                    // "K" and "k" name the same key.
+                    std::string lower(1, static_cast<char>(tolower(part[0])));
+                    keysym = XStringToKeysym(lower.c_str());
+                }
+                if (keysym == NoSymbol)
+                {
+                    return false;
+                }
+                keycode_ = XKeysymToKeycode(display, keysym);
+                break;
+            }
+
+            if (strcasecmp(part.c_str(), "ctrl") == 0 || strcasecmp(part.c_str(), "control") == 0)
+            {
+                modifiers |= ControlMask;
+            }
+            else if (strcasecmp(part.c_str(), "alt") == 0)
+            {
+                modifiers |= Mod1Mask;
+            }
+            else if (strcasecmp(part.c_str(), "shift") == 0)
+            {
+                modifiers |= ShiftMask;
+            }
+            else if (strcasecmp(part.c_str(), "super") == 0)
+            {
+                modifiers |= Mod4Mask;
+            }
+            else
+            {
+                return false;
+            }
+            start = end + 1;
+        }
+        if (keycode_ == 0)
+        {
+            return false;
+        }
+
+        display_ = display;
+        modifiers_ = modifiers;
+        down_ = false;
+
+        // Report a held key as repeated presses without the synthetic
+        // releases in between, so the press can be told from the repeats.
+        Bool detectable = False;
+        XkbSetDetectableAutoRepeat(display, True, &detectable);
+
+        // Another client holding the combination shows up as an asynchronous BadAccess.
+        XSync(display, False);
+        grabFailed = false;
+        XErrorHandler previous = XSetErrorHandler(recordGrabError);
+        for (unsigned int ignored : ignoredModifiers)
+        {
+            XGrabKey(display, keycode_, modifiers_ | ignored, DefaultRootWindow(display), True, GrabModeAsync, GrabModeAsync);
+        }
+        XSync(display, False);
+        XSetErrorHandler(previous);
+        if (grabFailed)
+        {
+            ungrab();
+            return false;
+        }
+        return true;
+    }
+
+    void Hotkey::ungrab()
+    {
+        if (display_ == nullptr)
+        {
+            return;
+        }
+        for (unsigned int ignored : ignoredModifiers)
+        {
+            XUngrabKey(display_, keycode_, modifiers_ | ignored, DefaultRootWindow(display_));
+        }
+        display_ = nullptr;
+    }
+
+    bool Hotkey::matches(const XEvent &ev)
+    {
+        if (display_ == nullptr || (ev.type != KeyPress && ev.type != KeyRelease) || ev.xkey.keycode != keycode_)
+        {
+            return false;
+        }
+        if (ev.type == KeyRelease)
+        {
+            // The modifiers may already be up when the key is released.
+            down_ = false;
+            releaseTime_ = ev.xkey.time;
+            return false;
+        }
+
+        const unsigned int relevant = ControlMask | Mod1Mask | ShiftMask | Mod4Mask;
+        // Without detectable autorepeat a repeat is a release and a press with the same time.
+        bool repeat = down_ || ev.xkey.time == releaseTime_;
+        down_ = true;
+        return !repeat && (ev.xkey.state & relevant) == modifiers_;
+    }
+
+    StateOsd::~StateOsd()
+    {
+        destroy();
+    }
+
+    void StateOsd::create(Display *display)
+    {
+        destroy();
+        display_ = display;
+        int screen = DefaultScreen(display);
+
+        XSetWindowAttributes attributes;
+        attributes.override_redirect = True;
+        attributes.background_pixel = BlackPixel(display, screen);
+        attributes.event_mask = ExposureMask;
+        int x = (DisplayWidth(display, screen) - osdWidth) / 2;
+        int y = DisplayHeight(display, screen) / 8;
+        win_ = XCreateWindow(display, RootWindow(display, screen), x, y, osdWidth, osdHeight, 0, CopyFromParent, InputOutput,
+                             CopyFromParent, CWOverrideRedirect | CWBackPixel | CWEventMask, &attributes);
+        gc_ = XCreateGC(display, win_, 0, NULL);
+
+        activePixmap_ = renderMessage(display, win_, gc_, "caffeine8: keeping awake", namedColor(display, "sea green", WhitePixel(display, screen)));
+        pausedPixmap_ = renderMessage(display, win_, gc_, "caffeine8: paused", namedColor(display, "dark orange", WhitePixel(display, screen)));
+    }
+
+    void StateOsd::show(bool active)
+    {
+        if (display_ == nullptr)
+        {
+            return;
+        }
+        active_ = active;
+        hideAt_ = std::chrono::steady_clock::now() + osdTimeout;
+        if (!visible_)
+        {
+            XMapRaised(display_, win_);
+            visible_ = true;
+        }
+        XCopyArea(display_, active_ ? activePixmap_ : pausedPixmap_, win_, gc_, 0, 0, osdWidth, osdHeight, 0, 0);
+        XFlush(display_);
+    }
+
+    bool StateOsd::handleEvent(const XEvent &ev)
+    {
+        if (display_ == nullptr || ev.xany.window != win_)
+        {
+            return false;
+        }
+        if (ev.type == Expose && ev.xexpose.count == 0)
+        {
+            XCopyArea(display_, active_ ? activePixmap_ : pausedPixmap_, win_, gc_, 0, 0, osdWidth, osdHeight, 0, 0);
+        }
+        return true;
+    }
+
+    void StateOsd::update(std::chrono::steady_clock::time_point now)
+    {
+        if (visible_ && now >= hideAt_)
+        {
+            XUnmapWindow(display_, win_);
+            XFlush(display_);
+            visible_ = false;
+        }
+    }
+
+    void StateOsd::destroy()
+    {
+        if (display_ == nullptr)
+        {
+            return;
+        }
+        XFreePixmap(display_, activePixmap_);
+        XFreePixmap(display_, pausedPixmap_);
+        XFreeGC(display_, gc_);
+        XDestroyWindow(display_, win_);
+        display_ = nullptr;
+        visible_ = false;
+    }
+
+} // namespace caffeine8
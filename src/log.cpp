@@ -0,0 +1,533 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "log.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        const char *const journalSocketPath = "/run/systemd/journal/socket";
+        const char *const syslogSocketPath = "/dev/log";
+
+        /// Number of queue slots; must be a power of two.
+        const size_t queueSize = 256;
+
+        /// At most rateLimitBurst messages are written per rateLimitInterval seconds.
+        const unsigned rateLimitBurst = 200;
+        const int64_t rateLimitInterval = 10;
+
+        struct LogRecord
+        {
+            int64_t time; // Unix time in microseconds.
+            int level;
+            uint32_t length;
+            char text[240];
+        };
+
+        /// A slot of the bounded multi-producer queue (Vyukov). The sequence
+        /// number tells producers and the consumer whose turn the slot is.
+        struct alignas(64) Slot
+        {
+            std::atomic<size_t> sequence;
+            LogRecord record;
+        };
+
+        enum class SinkType
+        {
+            Journal,
+            Syslog,
+            Stderr,
+            File
+        };
+
+        Slot slots[queueSize];
+        std::atomic<size_t> enqueuePos{0};
+        size_t dequeuePos = 0;
+
+        // Messages waiting in the queue; the producer that moves it off zero wakes the flusher.
+        std::atomic<size_t> pending{0};
+        std::atomic<size_t> dropped{0};
+        std::atomic<int> maxLevel{static_cast<int>(LogLevel::Info)};
+        std::atomic<bool> running{false};
+        std::atomic<bool> stopping{false};
+
+        int wakeFd = -1;
+        int sinkFd = -1;
+        SinkType sinkType = SinkType::Stderr;
+        std::string sinkPath;
+        std::thread flusher;
+
+        int64_t rateWindowStart = 0;
+        unsigned rateWindowCount = 0;
+        size_t suppressed = 0;
+
+        int64_t nowMicros()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+        }
+
+        bool push(const LogRecord &record)
+        {
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Slot &slot = slots[pos & (queueSize - 1)];
+                size_t sequence = slot.sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+                if (diff == 0)
+                {
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        slot.record = record;
+                        slot.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; // Full.
+                }
+                else
+                {
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool pop(LogRecord &record)
+        {
+            Slot &slot = slots[dequeuePos & (queueSize - 1)];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence != dequeuePos + 1)
+            {
+                return false; // Empty, or the producer has not finished writing.
+            }
+            record = slot.record;
+            slot.sequence.store(dequeuePos + queueSize, std::memory_order_release);
+            dequeuePos++;
+            return true;
+        }
+
+        void wakeFlusher()
+        {
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFd, &one, sizeof(one));
+            (void)ignored;
+        }
+
+        /// Appends a journal field, using the binary form when the value contains a newline.
+        void appendJournalField(std::string &out, const char *name, const char *value, size_t length)
+        {
+            out += name;
+            if (memchr(value, '\n', length) == nullptr)
+            {
+                out += '=';
+                out.append(value, length);
+            }
+            else
+            {
+                out += '\n';
+                uint64_t size = length;
+                for (int i = 0; i < 8; ++i)
+                {
+                    out += static_cast<char>((size >> (8 * i)) & 0xff);
+                }
+                out.append(value, length);
+            }
+            out += '\n';
+        }
+
+        std::string formatRecord(const LogRecord &record)
+        {
+            std::string out;
+            char prefix[64];
+            time_t seconds = record.time / 1000000;
+            struct tm tm;
+            localtime_r(&seconds, &tm);
+
+            switch (sinkType)
+            {
+            case SinkType::Journal:
+                snprintf(prefix, sizeof(prefix), "PRIORITY=%d\nSYSLOG_IDENTIFIER=caffeine8\n", record.level);
+                out = prefix;
+                appendJournalField(out, "MESSAGE", record.text, record.length);
+                break;
+            case SinkType::Syslog:
+            {
+                // RFC 3164, facility user (1).
+                int n = snprintf(prefix, sizeof(prefix), "<%d>", 8 + record.level);
+                strftime(prefix + n, sizeof(prefix) - n, "%b %e %H:%M:%S ", &tm);
+                out = prefix;
+                out += "caffeine8[" + std::to_string(getpid()) + "]: ";
+                out.append(record.text, record.length);
+                break;
+            }
+            case SinkType::Stderr:
+            case SinkType::File:
+            {
+                int n = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &tm);
+                snprintf(prefix + n, sizeof(prefix) - n, ".%06d <%d> ", static_cast<int>(record.time % 1000000), record.level);
+                out = prefix;
+                out.append(record.text, record.length);
+                out += '\n';
+                break;
+            }
+            }
+            return out;
+        }
+
+        LogRecord suppressedNotice(int64_t time)
+        {
+            LogRecord notice = {};
+            notice.time = time;
+            notice.level = static_cast<int>(LogLevel::Warning);
+            notice.length = snprintf(notice.text, sizeof(notice.text), "%zu log messages suppressed by rate limit", suppressed);
+            suppressed = 0;
+            return notice;
+        }
+
+        /// Applies the rate limit; returns false if the record must be suppressed.
+        bool admit(const LogRecord &record, std::vector<LogRecord> &batch)
+        {
+            int64_t second = record.time / 1000000;
+            if (second - rateWindowStart >= rateLimitInterval)
+            {
+                if (suppressed > 0)
+                {
+                    batch.push_back(suppressedNotice(record.time));
+                }
+                rateWindowStart = second;
+                rateWindowCount = 0;
+            }
+            if (rateWindowCount >= rateLimitBurst)
+            {
+                suppressed++;
+                return false;
+            }
+            rateWindowCount++;
+            return true;
+        }
+
+        /// Writes a batch with as few system calls as the sink allows.
+        void writeBatch(const std::vector<LogRecord> &batch)
+        {
+            if (batch.empty() || sinkFd < 0)
+            {
+                return;
+            }
+
+            std::vector<std::string> messages;
+            messages.reserve(batch.size());
+            for (const LogRecord &record : batch)
+            {
+                messages.push_back(formatRecord(record));
+            }
+            std::vector<struct iovec> iov(messages.size());
+            for (size_t i = 0; i < messages.size(); ++i)
+            {
+                iov[i].iov_base = &messages[i][0];
+                iov[i].iov_len = messages[i].size();
+            }
+
+            if (sinkType == SinkType::Journal || sinkType == SinkType::Syslog)
+            {
+                // One datagram per entry, all sent in a single sendmmsg().
+                std::vector<struct mmsghdr> msgs(messages.size());
+                memset(msgs.data(), 0, msgs.size() * sizeof(struct mmsghdr));
+                for (size_t i = 0; i < messages.size(); ++i)
+                {
+                    msgs[i].msg_hdr.msg_iov = &iov[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                size_t sent = 0;
+                while (sent < msgs.size())
+                {
+                    int n = sendmmsg(sinkFd, msgs.data() + sent, msgs.size() - sent, MSG_NOSIGNAL);
+                    if (n < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (n <= 0)
+                    {
+                        break;
+                    }
+                    sent += n;
+                }
+                return;
+            }
+
+            for (size_t i = 0; i < iov.size(); i += IOV_MAX)
+            {
+                int count = static_cast<int>(std::min<size_t>(IOV_MAX, iov.size() - i));
+                while (writev(sinkFd, iov.data() + i, count) < 0 && errno == EINTR)
+                {
+                }
+            }
+        }
+
+        void flushLoop()
+        {
+            std::vector<LogRecord> batch;
+            batch.reserve(queueSize);
+            while (true)
+            {
+                if (pending.load(std::memory_order_acquire) == 0)
+                {
+                    if (stopping.load(std::memory_order_acquire))
+                    {
+                        if (suppressed > 0)
+                        {
+                            batch.clear();
+                            batch.push_back(suppressedNotice(nowMicros()));
+                            writeBatch(batch);
+                        }
+                        return;
+                    }
+                    // The eventfd counter keeps a wakeup sent between the check and the read.
+                    uint64_t wakeups;
+                    while (read(wakeFd, &wakeups, sizeof(wakeups)) < 0 && errno == EINTR)
+                    {
+                    }
+                    continue;
+                }
+
+                batch.clear();
+                LogRecord record;
+                size_t drained = 0;
+                while (pop(record))
+                {
+                    drained++;
+                    if (admit(record, batch))
+                    {
+                        batch.push_back(record);
+                    }
+                }
+
+                size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+                if (lost > 0)
+                {
+                    LogRecord notice = {};
+                    notice.time = nowMicros();
+                    notice.level = static_cast<int>(LogLevel::Warning);
+                    notice.length = snprintf(notice.text, sizeof(notice.text), "%zu log messages dropped, queue full", lost);
+                    batch.push_back(notice);
+                }
+                writeBatch(batch);
+
+                // A record still counted as pending but not poppable is being
+                // written by a producer that will not wake us again.
+                if (pending.fetch_sub(drained, std::memory_order_acq_rel) != drained && drained == 0)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        int connectDatagram(const std::string &path)
+        {
+            struct sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path))
+            {
+                return -1;
+            }
+            path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+            int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+            {
+                return -1;
+            }
+            if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+            {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        bool openSink(std::string target)
+        {
+            if (target.empty())
+            {
+                const char *env = getenv("CAFFEINE8_LOG");
+                target = env != nullptr ? env : "";
+            }
+            if (target.empty())
+            {
+                target = access(journalSocketPath, W_OK) == 0 ? "journal" : "syslog";
+            }
+
+            std::string kind = target.substr(0, target.find(':'));
+            std::string path = target.find(':') == std::string::npos ? "" : target.substr(target.find(':') + 1);
+            if (kind == "journal")
+            {
+                sinkType = SinkType::Journal;
+                sinkPath = path.empty() ? journalSocketPath : path;
+                sinkFd = connectDatagram(sinkPath);
+            }
+            else if (kind == "syslog")
+            {
+                sinkType = SinkType::Syslog;
+                sinkPath = path.empty() ? syslogSocketPath : path;
+                sinkFd = connectDatagram(sinkPath);
+            }
+            else if (kind == "file" && !path.empty())
+            {
+                sinkType = SinkType::File;
+                sinkPath = path;
+                sinkFd = open(sinkPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            }
+            else if (kind == "stderr")
+            {
+                sinkType = SinkType::Stderr;
+                sinkFd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+            }
+            return sinkFd >= 0;
+        }
+
+        void readLevel()
+        {
+            const char *env = getenv("CAFFEINE8_LOG_LEVEL");
+            std::string level = env != nullptr ? env : "";
+            if (level == "error")
+            {
+                maxLevel = static_cast<int>(LogLevel::Error);
+            }
+            else if (level == "warning")
+            {
+                maxLevel = static_cast<int>(LogLevel::Warning);
+            }
+            else if (level == "debug")
+            {
+                maxLevel = static_cast<int>(LogLevel::Debug);
+            }
+            else
+            {
+                maxLevel = static_cast<int>(LogLevel::Info);
+            }
+        }
+    } // namespace
+
+    bool startLogger(const std::string &target)
+    {
+        if (running.load())
+        {
+            return true;
+        }
+        readLevel();
+
+        for (size_t i = 0; i < queueSize; ++i)
+        {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueuePos.store(0);
+        dequeuePos = 0;
+        pending.store(0);
+        dropped.store(0);
+        stopping.store(false);
+        rateWindowStart = 0;
+        rateWindowCount = 0;
+        suppressed = 0;
+
+        if (!openSink(target))
+        {
+            return false;
+        }
+        wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (wakeFd < 0)
+        {
+            close(sinkFd);
+            sinkFd = -1;
+            return false;
+        }
+
+        flusher = std::thread(flushLoop);
+        running.store(true, std::memory_order_release);
+        return true;
+    }
+
+    void stopLogger()
+    {
+        if (!running.exchange(false))
+        {
+            return;
+        }
+        stopping.store(true, std::memory_order_release);
+        wakeFlusher();
+        flusher.join();
+
+        close(wakeFd);
+        wakeFd = -1;
+        close(sinkFd);
+        sinkFd = -1;
+    }
+
+    bool logEnabled(LogLevel level)
+    {
+        return running.load(std::memory_order_acquire) && static_cast<int>(level) <= maxLevel.load(std::memory_order_relaxed);
+    }
+
+    void logMessage(LogLevel level, const char *format, ...)
+    {
+        if (!logEnabled(level))
+        {
+            return;
+        }
+
+        LogRecord record;
+        record.time = nowMicros();
+        record.level = static_cast<int>(level);
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(record.text, sizeof(record.text), format, args);
+        va_end(args);
+        record.length = length < 0 ? 0 : std::min<uint32_t>(length, sizeof(record.text) - 1);
+
+        if (!push(record))
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+        {
+            wakeFlusher();
+        }
+    }
+
+} // namespace caffeine8
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "replay.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        const char traceMagic[8] = {'C', '8', 'X', 'E', 'V', 'T', '0', '1'};
+
+        struct TraceHeader
+        {
+            char magic[8];
+            uint16_t width;
+            uint16_t height;
+            uint32_t reserved;
+        };
+
+        static_assert(sizeof(TraceHeader) == 16, "TraceHeader layout changed");
+        static_assert(sizeof(RecordedEvent) == 16, "RecordedEvent layout changed");
+
+        uint16_t clampSize(int value)
+        {
+            return static_cast<uint16_t>(std::min(std::max(value, 0), 0xffff));
+        }
+
+        int16_t clampPosition(int value)
+        {
+            return static_cast<int16_t>(std::min(std::max(value, -0x8000), 0x7fff));
+        }
+    } // namespace
+
+    EventRecorder::~EventRecorder()
+    {
+        close();
+    }
+
+    bool EventRecorder::open(const std::string &path, int width, int height)
+    {
+        close();
+        file_ = fopen(path.c_str(), "wb");
+        if (file_ == nullptr)
+        {
+            return false;
+        }
+
+        TraceHeader header = {};
+        std::memcpy(header.magic, traceMagic, sizeof(header.magic));
+        header.width = clampSize(width);
+        header.height = clampSize(height);
+        if (fwrite(&header, sizeof(header), 1, file_) != 1)
+        {
+            close();
+            return false;
+        }
+        last_ = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void EventRecorder::record(const XEvent &ev)
+    {
+        if (file_ == nullptr)
+        {
+            return;
+        }
+        flushPending();
+
+        auto now = std::chrono::steady_clock::now();
+        long long delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last_).count();
+        last_ = now;
+
+        RecordedEvent &recorded = pending_;
+        std::memset(&recorded, 0, sizeof(recorded));
+        recorded.delta_us = static_cast<uint32_t>(std::min<long long>(delta, UINT32_MAX));
+        recorded.type = static_cast<uint16_t>(ev.type);
+        if (ev.type == ConfigureNotify)
+        {
+            recorded.x = clampPosition(ev.xconfigure.x);
+            recorded.y = clampPosition(ev.xconfigure.y);
+            recorded.width = clampSize(ev.xconfigure.width);
+            recorded.height = clampSize(ev.xconfigure.height);
+        }
+        else if (ev.type == Expose)
+        {
+            recorded.x = clampPosition(ev.xexpose.x);
+            recorded.y = clampPosition(ev.xexpose.y);
+            recorded.width = clampSize(ev.xexpose.width);
+            recorded.height = clampSize(ev.xexpose.height);
+        }
+        hasPending_ = true;
+    }
+
+    void EventRecorder::endBatch()
+    {
+        if (hasPending_)
+        {
+            pending_.flags |= RecordedEvent::EndOfBatch;
+            flushPending();
+        }
+    }
+
+    void EventRecorder::flushPending()
+    {
+        if (hasPending_)
+        {
+            fwrite(&pending_, sizeof(pending_), 1, file_);
+            hasPending_ = false;
+        }
+    }
+
+    void EventRecorder::close()
+    {
+        if (file_ != nullptr)
+        {
+            endBatch();
+            fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+    bool loadEventTrace(const std::string &path, EventTrace &trace)
+    {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        TraceHeader header;
+        if (fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, traceMagic, sizeof(traceMagic)) != 0)
+        {
+            fclose(file);
+            return false;
+        }
+        trace.width = header.width;
+        trace.height = header.height;
+        trace.events.clear();
+
+        RecordedEvent recorded;
+        while (fread(&recorded, sizeof(recorded), 1, file) == 1)
+        {
+            trace.events.push_back(recorded);
+        }
+        fclose(file);
+        return true;
+    }
+
+    void toXEvent(const RecordedEvent &recorded, Window win, XEvent &ev)
+    {
+        std::memset(&ev, 0, sizeof(ev));
+        ev.type = recorded.type;
+        ev.xany.window = win;
+        if (recorded.type == ConfigureNotify)
+        {
+            ev.xconfigure.event = win;
+            ev.xconfigure.window = win;
+            ev.xconfigure.x = recorded.x;
+            ev.xconfigure.y = recorded.y;
+            ev.xconfigure.width = recorded.width;
+            ev.xconfigure.height = recorded.height;
+        }
+        else if (recorded.type == Expose)
+        {
+            ev.xexpose.x = recorded.x;
+            ev.xexpose.y = recorded.y;
+            ev.xexpose.width = recorded.width;
+            ev.xexpose.height = recorded.height;
+        }
+    }
+
+} // namespace caffeine8
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <X11/Xatom.h>
+#include "assets.h"
+#include "caffeine8.h"
+#include "control.h"
+#include "log.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        /// Icon size until the tray assigns one.
+        const int defaultIconSize = 22;
+
+        const long systemTrayRequestDock = 0;
+        const long xembedVersion = 0;
+        const long xembedMapped = 1;
+
+        enum TrayState
+        {
+            TrayActive,
+            TrayPaused,
+            TrayError,
+            TrayStateCount
+        };
+
+        /// State of the tray icon window.
+        struct TrayIcon
+        {
+            Display *display;
+            int screen;
+            Window win;
+            GC gc;
+            Atom selection;    // _NET_SYSTEM_TRAY_S<screen>
+            Atom opcode;       // _NET_SYSTEM_TRAY_OPCODE
+            Atom manager_atom; // MANAGER
+            Window manager;
+            int size;
+            Pixmap icons[TrayStateCount];
+            TrayState state;
+            std::string tooltip;
+        };
+
+        /**
+         * Draws a cup in the colour of the state: steam rises from it while
+         * active, pause bars stand above it when paused and an exclamation
+         * mark when the keep-awake call fails or the daemon is gone.
+         */
+        Pixmap renderIcon(const TrayIcon &t, TrayState state)
+        {
+            Display *display = t.display;
+            int s = t.size;
+            Pixmap pixmap = XCreatePixmap(display, t.win, s, s, DefaultDepth(display, t.screen));
+
+            static const char *const colors[TrayStateCount] = {"sea green", "dark orange", "firebrick"};
+            unsigned long accent = namedColor(display, colors[state], WhitePixel(display, t.screen));
+            XSetForeground(display, t.gc, namedColor(display, "gray20", BlackPixel(display, t.screen)));
+            XFillRectangle(display, pixmap, t.gc, 0, 0, s, s);
+
+            int line = std::max(1, s / 11);
+            XSetForeground(display, t.gc, accent);
+            XSetLineAttributes(display, t.gc, line, LineSolid, CapRound, JoinRound);
+            XFillRectangle(display, pixmap, t.gc, s * 2 / 10, s * 45 / 100, s * 5 / 10, s * 3 / 10);
+            XFillArc(display, pixmap, t.gc, s * 2 / 10, s * 6 / 10, s * 5 / 10, s * 3 / 10, 180 * 64, 180 * 64);
+            XDrawArc(display, pixmap, t.gc, s * 6 / 10, s * 5 / 10, s * 2 / 10, s * 2 / 10, -90 * 64, 180 * 64);
+            XFillRectangle(display, pixmap, t.gc, s / 10, s * 9 / 10, s * 7 / 10, line);
+
+            int top = s / 10;
+            int height = s * 3 / 10;
+            if (state == TrayActive)
+            {
+                for (int x : {s * 3 / 10, s * 5 / 10})
+                {
+                    XDrawArc(display, pixmap, t.gc, x, top, s / 10, height / 2, 90 * 64, 180 * 64);
+                    XDrawArc(display, pixmap, t.gc, x, top + height / 2, s / 10, height / 2, 90 * 64, -180 * 64);
+                }
+            }
+            else if (state == TrayPaused)
+            {
+                XFillRectangle(display, pixmap, t.gc, s * 3 / 10, top, std::max(1, s / 10), height);
+                XFillRectangle(display, pixmap, t.gc, s * 5 / 10, top, std::max(1, s / 10), height);
+            }
+            else
+            {
+                XFillRectangle(display, pixmap, t.gc, s * 45 / 100, top, std::max(1, s / 10), height * 2 / 3);
+                XFillRectangle(display, pixmap, t.gc, s * 45 / 100, top + height * 5 / 6, std::max(1, s / 10), std::max(1, s / 10));
+            }
+            XSetLineAttributes(display, t.gc, 0, LineSolid, CapButt, JoinMiter);
+            return pixmap;
+        }
+
+        /// Renders every state at the current size; called only when the size changes.
+        void renderIcons(TrayIcon &t)
+        {
+            for (int state = 0; state < TrayStateCount; ++state)
+            {
+                if (t.icons[state] != None)
+                {
+                    XFreePixmap(t.display, t.icons[state]);
+                }
+                t.icons[state] = renderIcon(t, static_cast<TrayState>(state));
+            }
+        }
+
+        void drawIcon(const TrayIcon &t)
+        {
+            XCopyArea(t.display, t.icons[t.state], t.win, t.gc, 0, 0, t.size, t.size, 0, 0);
+        }
+
+        /**
+         * Asks the current tray manager to embed the icon window. Without a
+         * manager the window stays unmapped until one announces itself.
+         */
+        void dock(TrayIcon &t)
+        {
+            // Keep the manager from vanishing between looking it up and selecting its events.
+            XGrabServer(t.display);
+            t.manager = XGetSelectionOwner(t.display, t.selection);
+            if (t.manager != None)
+            {
+                XSelectInput(t.display, t.manager, StructureNotifyMask);
+            }
+            XUngrabServer(t.display);
+            if (t.manager == None)
+            {
+                logMessage(LogLevel::Info, "No system tray yet, waiting for one");
+                return;
+            }
+
+            XEvent ev;
+            std::memset(&ev, 0, sizeof(ev));
+            ev.xclient.type = ClientMessage;
+            ev.xclient.window = t.manager;
+            ev.xclient.message_type = t.opcode;
+            ev.xclient.format = 32;
+            ev.xclient.data.l[0] = CurrentTime;
+            ev.xclient.data.l[1] = systemTrayRequestDock;
+            ev.xclient.data.l[2] = t.win;
+            XSendEvent(t.display, t.manager, False, NoEventMask, &ev);
+            XFlush(t.display);
+        }
+
+        void setState(TrayIcon &t, TrayState state, const std::string &tooltip)
+        {
+            if (tooltip != t.tooltip)
+            {
+                t.tooltip = tooltip;
+                XStoreName(t.display, t.win, tooltip.c_str());
+            }
+            if (state != t.state)
+            {
+                t.state = state;
+                drawIcon(t);
+            }
+        }
+    } // namespace
+
+    void showTray()
+    {
+        Display *display = XOpenDisplay(NULL);
+        if (display == NULL)
+        {
+            std::cerr << "Cannot open display" << std::endl;
+            return;
+        }
+
+        TrayIcon t;
+        t.display = display;
+        t.screen = DefaultScreen(display);
+        t.size = defaultIconSize;
+        t.state = TrayError;
+        t.manager = None;
+        std::fill(t.icons, t.icons + TrayStateCount, None);
+        std::string selectionName = "_NET_SYSTEM_TRAY_S" + std::to_string(t.screen);
+        t.selection = XInternAtom(display, selectionName.c_str(), False);
+        t.opcode = XInternAtom(display, "_NET_SYSTEM_TRAY_OPCODE", False);
+        t.manager_atom = XInternAtom(display, "MANAGER", False);
+
+        bool displayLost = false;
+        watchDisplayLoss(display, displayLost);
+
+        Window root = RootWindow(display, t.screen);
+        t.win = XCreateSimpleWindow(display, root, 0, 0, t.size, t.size, 0, BlackPixel(display, t.screen), BlackPixel(display, t.screen));
+        XStoreName(display, t.win, "caffeine8");
+        // Without a tray the icon can end up as a toplevel that the window manager offers to close.
+        Atom deleteWindow = XInternAtom(display, "WM_DELETE_WINDOW", False);
+        XSetWMProtocols(display, t.win, &deleteWindow, 1);
+        XSelectInput(display, t.win, ExposureMask | StructureNotifyMask);
+        // Tray managers announce themselves with a MANAGER client message on the root window.
+        XSelectInput(display, root, StructureNotifyMask);
+
+        long xembedInfo[2] = {xembedVersion, xembedMapped};
+        Atom xembedInfoAtom = XInternAtom(display, "_XEMBED_INFO", False);
+        XChangeProperty(display, t.win, xembedInfoAtom, xembedInfoAtom, 32, PropModeReplace, reinterpret_cast<unsigned char *>(xembedInfo), 2);
+
+        t.gc = XCreateGC(display, t.win, 0, NULL);
+        renderIcons(t);
+        dock(t);
+
+        DaemonStatus status;
+        StatusSubscription daemon;
+        daemon.start();
+        if (!daemon.connected())
+        {
+            setState(t, TrayError, "caffeine8: not running");
+        }
+
+        bool quit = false;
+        bool destroyed = false;
+        while (!quit && !displayLost)
+        {
+            XFlush(display);
+            struct pollfd fds[2] = {{ConnectionNumber(display), POLLIN, 0}, {daemon.fd(), POLLIN, 0}};
+            // Nothing is redrawn on a timer; without a daemon the only wake-up is the reconnect attempt.
+            if (XPending(display) == 0 && poll(fds, 2, daemon.timeoutMs()) < 0 && errno != EINTR)
+            {
+                logMessage(LogLevel::Error, "poll failed: %s", strerror(errno));
+                break;
+            }
+
+            if (daemon.update(status))
+            {
+                if (!daemon.known())
+                {
+                    setState(t, TrayError, "caffeine8: not running");
+                }
+                else
+                {
+                    TrayState state = !status.active ? TrayPaused : status.failing ? TrayError : TrayActive;
+                    std::string tooltip = !status.active ? "caffeine8: paused" : status.failing ? "caffeine8: " + status.last_error : "caffeine8: keeping awake";
+                    setState(t, state, tooltip);
+                }
+            }
+
+            while (!quit && XPending(display) > 0)
+            {
+                XEvent ev;
+                XNextEvent(display, &ev);
+                if (ev.type == ClientMessage && ev.xclient.window == root && ev.xclient.message_type == t.manager_atom &&
+                    static_cast<Atom>(ev.xclient.data.l[1]) == t.selection)
+                {
+                    dock(t);
+                }
+                else if (ev.type == DestroyNotify && ev.xdestroywindow.window == t.manager)
+                {
+                    // The manager's save-set puts the icon back on the root
+                    // window; hide it until the next manager docks it.
+                    t.manager = None;
+                    XUnmapWindow(display, t.win);
+                }
+                else if (ev.type == ClientMessage && ev.xclient.window == t.win && static_cast<Atom>(ev.xclient.data.l[0]) == deleteWindow)
+                {
+                    quit = true;
+                }
+                else if (ev.type == DestroyNotify && ev.xdestroywindow.window == t.win)
+                {
+                    destroyed = true;
+                    quit = true;
+                }
+                else if (ev.type == ConfigureNotify && ev.xconfigure.window == t.win)
+                {
+                    int size = std::max(1, std::min(ev.xconfigure.width, ev.xconfigure.height));
+                    if (size != t.size)
+                    {
+                        t.size = size;
+                        renderIcons(t);
+                        drawIcon(t);
+                    }
+                }
+                else if (ev.type == Expose && ev.xexpose.window == t.win && ev.xexpose.count == 0)
+                {
+                    drawIcon(t);
+                }
+            }
+        }
+
+        if (displayLost)
+        {
+            logMessage(LogLevel::Error, "Lost connection to the X server");
+        }
+        else
+        {
+            for (Pixmap icon : t.icons)
+            {
+                XFreePixmap(display, icon);
+            }
+            XFreeGC(display, t.gc);
+            if (!destroyed)
+            {
+                XDestroyWindow(display, t.win);
+            }
+        }
+        XCloseDisplay(display);
+    }
+
+} // namespace caffeine8
@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <termios.h>
+#include <vector>
+#include "caffeine8.h"
+#include "control.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        const char ctrlD = 0x04;
+
+        enum CellStyle : uint8_t
+        {
+            StyleNormal,
+            StyleBold,
+            StyleActive,
+            StylePaused,
+            StyleError,
+            StyleDim,
+            StyleUnknown
+        };
+
+        /// SGR sequences for the styles, each starting from the default attributes.
+        const char *const styleSequences[] = {"\x1b[0m", "\x1b[0;1m", "\x1b[0;1;32m", "\x1b[0;1;33m", "\x1b[0;1;31m", "\x1b[0;2m"};
+
+        struct Cell
+        {
+            char ch = ' ';
+            CellStyle style = StyleNormal;
+
+            bool operator==(const Cell &other) const { return ch == other.ch && style == other.style; }
+            bool operator!=(const Cell &other) const { return !(*this == other); }
+        };
+
+        /**
+         * A terminal screen kept as two cell grids: the one being drawn and
+         * the one last sent to the terminal. flush() emits escape sequences
+         * for the cells that differ and nothing else, so redrawing the whole
+         * layout on every update costs only the bytes that changed.
+         */
+        class ScreenBuffer
+        {
+        public:
+            /// Sets the size; the next flush() clears the terminal and sends every non-blank cell.
+            void resize(int width, int height)
+            {
+                width_ = std::max(0, width);
+                height_ = std::max(0, height);
+                back_.assign(static_cast<size_t>(width_) * height_, Cell());
+                front_ = back_;
+                clearPending_ = true;
+            }
+
+            void clear()
+            {
+                std::fill(back_.begin(), back_.end(), Cell());
+            }
+
+            /// Writes text at a position, clipped to the screen; non-printable bytes become '?'.
+            void put(int x, int y, const std::string &text, CellStyle style = StyleNormal)
+            {
+                if (y < 0 || y >= height_)
+                {
+                    return;
+                }
+                for (size_t i = 0; i < text.size() && x + static_cast<int>(i) < width_; ++i)
+                {
+                    if (x + static_cast<int>(i) < 0)
+                    {
+                        continue;
+                    }
+                    unsigned char ch = text[i];
+                    Cell &cell = back_[static_cast<size_t>(y) * width_ + x + i];
+                    cell.ch = ch >= 0x20 && ch < 0x7f ? static_cast<char>(ch) : '?';
+                    cell.style = style;
+                }
+            }
+
+            /// Returns the escape sequences that bring the terminal up to date with the drawn cells.
+            std::string flush()
+            {
+                std::string out;
+                if (clearPending_)
+                {
+                    out += "\x1b[0m\x1b[2J";
+                    clearPending_ = false;
+                }
+
+                int cursorX = -1;
+                int cursorY = -1;
+                CellStyle style = StyleUnknown;
+                for (int y = 0; y < height_; ++y)
+                {
+                    for (int x = 0; x < width_; ++x)
+                    {
+                        size_t index = static_cast<size_t>(y) * width_ + x;
+                        if (back_[index] == front_[index])
+                        {
+                            continue;
+                        }
+                        if (x != cursorX || y != cursorY)
+                        {
+                            char move[32];
+                            snprintf(move, sizeof(move), "\x1b[%d;%dH", y + 1, x + 1);
+                            out += move;
+                        }
+                        if (back_[index].style != style)
+                        {
+                            style = back_[index].style;
+                            out += styleSequences[style];
+                        }
+                        out += back_[index].ch;
+                        front_[index] = back_[index];
+                        // Writing the last column leaves the cursor position terminal dependent.
+                        cursorX = x + 1 < width_ ? x + 1 : -1;
+                        cursorY = y;
+                    }
+                }
+                if (style != StyleUnknown && style != StyleNormal)
+                {
+                    out += styleSequences[StyleNormal];
+                }
+                return out;
+            }
+
+            int width() const { return width_; }
+            int height() const { return height_; }
+
+        private:
+            int width_ = 0;
+            int height_ = 0;
+            std::vector<Cell> back_;
+            std::vector<Cell> front_;
+            bool clearPending_ = true;
+        };
+
+        bool writeAll(int fd, const std::string &data)
+        {
+            size_t written = 0;
+            while (written < data.size())
+            {
+                ssize_t n = write(fd, data.data() + written, data.size() - written);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    return false;
+                }
+                written += n;
+            }
+            return true;
+        }
+
+        void terminalSize(ScreenBuffer &screen)
+        {
+            struct winsize size;
+            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 0)
+            {
+                screen.resize(size.ws_col, size.ws_row);
+            }
+            else
+            {
+                screen.resize(80, 24);
+            }
+        }
+
+        void drawStatus(ScreenBuffer &screen, const DaemonStatus &status, bool connected)
+        {
+            screen.clear();
+            screen.put(1, 0, "caffeine8 " + VERSION, StyleBold);
+
+            const int labelX = 1;
+            const int valueX = 14;
+            int y = 2;
+            screen.put(labelX, y, "State");
+            if (!connected)
+            {
+                screen.put(valueX, y, "not running", StyleError);
+            }
+            else if (!status.active)
+            {
+                screen.put(valueX, y, "paused", StylePaused);
+            }
+            else if (status.failing)
+            {
+                screen.put(valueX, y, "keep-awake call failing", StyleError);
+            }
+            else
+            {
+                screen.put(valueX, y, "keeping awake", StyleActive);
+            }
+
+            if (connected)
+            {
+                screen.put(labelX, ++y, "PID");
+                screen.put(valueX, y, std::to_string(status.pid));
+                screen.put(labelX, ++y, "Daemon");
+                screen.put(valueX, y, status.version);
+                screen.put(labelX, ++y, "Ticks");
+                screen.put(valueX, y, std::to_string(status.ticks));
+                screen.put(labelX, ++y, "Errors");
+                screen.put(valueX, y, std::to_string(status.errors), status.errors > 0 ? StyleError : StyleNormal);
+                screen.put(labelX, ++y, "Last error");
+                screen.put(valueX, y, status.last_error.empty() ? "NONE" : status.last_error);
+            }
+
+            screen.put(labelX, screen.height() - 1, "q or Ctrl-D to quit", StyleDim);
+        }
+    } // namespace
+
+    void showTui()
+    {
+        struct termios saved;
+        if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0)
+        {
+            std::cerr << "attach --tui needs a terminal" << std::endl;
+            return;
+        }
+
+        // Resizes and termination requests arrive on a signalfd so the
+        // terminal is always restored and poll() is the only wait.
+        sigset_t signals;
+        sigset_t previousMask;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGWINCH);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGHUP);
+        sigprocmask(SIG_BLOCK, &signals, &previousMask);
+        int signalFd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+
+        struct termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+        writeAll(STDOUT_FILENO, "\x1b[?1049h\x1b[?25l"); // Alternate screen, hidden cursor.
+
+        ScreenBuffer screen;
+        terminalSize(screen);
+        DaemonStatus status;
+        StatusSubscription daemon;
+        daemon.start();
+        bool dirty = true;
+        bool quit = false;
+        while (!quit)
+        {
+            // A fresh subscription answers at once; wait for it rather than flash "not running".
+            if (dirty && (daemon.known() || !daemon.connected()))
+            {
+                drawStatus(screen, status, daemon.known());
+                writeAll(STDOUT_FILENO, screen.flush());
+                dirty = false;
+            }
+
+            struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {signalFd, POLLIN, 0}, {daemon.fd(), POLLIN, 0}};
+            if (poll(fds, 3, daemon.timeoutMs()) < 0 && errno != EINTR)
+            {
+                break;
+            }
+
+            if (fds[0].revents != 0)
+            {
+                char input[64];
+                ssize_t n = read(STDIN_FILENO, input, sizeof(input));
+                if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+                {
+                    quit = true;
+                }
+                for (ssize_t i = 0; i < n; ++i)
+                {
+                    quit = quit || input[i] == 'q' || input[i] == 'Q' || input[i] == ctrlD;
+                }
+            }
+
+            struct signalfd_siginfo info;
+            while (read(signalFd, &info, sizeof(info)) == sizeof(info))
+            {
+                if (info.ssi_signo == SIGWINCH)
+                {
+                    terminalSize(screen);
+                    dirty = true;
+                }
+                else
+                {
+                    quit = true;
+                }
+            }
+
+            dirty = daemon.update(status) || dirty;
+        }
+
+        writeAll(STDOUT_FILENO, "\x1b[0m\x1b[?25h\x1b[?1049l");
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+        close(signalFd);
+        sigprocmask(SIG_SETMASK, &previousMask, NULL);
+    }
+
+} // namespace caffeine8
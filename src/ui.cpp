@@ -0,0 +1,628 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "animation.h"
+#include "assets.h"
+#include "caffeine8.h"
+#include "control.h"
+#include "history.h"
+#include "log.h"
+#include "replay.h"
+
+namespace caffeine8
+{
+    namespace
+    {
+        /// Size of the cached performance overlay in the bottom right corner.
+        const int overlayWidth = 250;
+        const int overlayHeight = 84;
+
+        /// Statistics shown by the performance overlay.
+        struct FrameStats
+        {
+            const char *scale_path = "nearest";
+            long long scale_us = 0;
+            long long upload_us = 0;
+            unsigned long events_coalesced = 0;
+            unsigned long frames_skipped = 0;
+            long long tick_us = -1; // Daemon's last tick latency, -1 if unknown.
+        };
+
+        /// State of the attach window shared by the event loop and the frame renderer.
+        struct AttachWindow
+        {
+            Display *display;
+            int screen;
+            Window win;
+            GC gc;
+            XImage *banner;
+            XImage *title;
+            int banner_width;
+            int banner_height;
+            int title_width;
+            int title_height;
+            int win_width;
+            int win_height;
+            int scaled_width;  // Size the banner was last drawn at.
+            int scaled_height;
+            bool mapped;
+            bool obscured;
+            pid_t pid;
+
+            bool perf_overlay;
+            bool measure; // Wait for the server to finish each frame so it can be timed.
+            FrameStats stats;
+            Pixmap overlay_pixmap;
+            std::vector<std::string> overlay_lines; // Lines currently drawn into overlay_pixmap.
+            HistoryLog history;
+            bool history_open;
+        };
+
+        long long elapsedMicros(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        /// CPU time between two getrusage() samples, in microseconds.
+        long long cpuMicros(const struct timeval &from, const struct timeval &to)
+        {
+            return (to.tv_sec - from.tv_sec) * 1000000LL + (to.tv_usec - from.tv_usec);
+        }
+
+        void drawOverlay(AttachWindow &w)
+        {
+            if (w.history_open && w.history.refresh())
+            {
+                HistoryRecord tick;
+                if (w.history.lastRecord(HistoryEvent::Tick, tick))
+                {
+                    w.stats.tick_us = tick.aux;
+                }
+            }
+
+            char buffer[64];
+            std::vector<std::string> lines;
+            snprintf(buffer, sizeof(buffer), "scale path: %s", w.stats.scale_path);
+            lines.push_back(buffer);
+            snprintf(buffer, sizeof(buffer), "scale: %lld us  upload: %lld us", w.stats.scale_us, w.stats.upload_us);
+            lines.push_back(buffer);
+            snprintf(buffer, sizeof(buffer), "coalesced: %lu  skipped: %lu", w.stats.events_coalesced, w.stats.frames_skipped);
+            lines.push_back(buffer);
+            if (w.stats.tick_us >= 0)
+            {
+                snprintf(buffer, sizeof(buffer), "daemon tick: %lld us", w.stats.tick_us);
+            }
+            else
+            {
+                snprintf(buffer, sizeof(buffer), "daemon tick: n/a");
+            }
+            lines.push_back(buffer);
+
+            // Only redraw the cached pixmap when the text changed; the window
+            // itself just gets a copy of it after every frame.
+            if (lines != w.overlay_lines)
+            {
+                XSetForeground(w.display, w.gc, BlackPixel(w.display, w.screen));
+                XFillRectangle(w.display, w.overlay_pixmap, w.gc, 0, 0, overlayWidth, overlayHeight);
+                XSetForeground(w.display, w.gc, WhitePixel(w.display, w.screen));
+                XDrawRectangle(w.display, w.overlay_pixmap, w.gc, 0, 0, overlayWidth - 1, overlayHeight - 1);
+                int y = 18;
+                for (const std::string &line : lines)
+                {
+                    XDrawString(w.display, w.overlay_pixmap, w.gc, 8, y, line.c_str(), line.length());
+                    y += 18;
+                }
+                w.overlay_lines = lines;
+            }
+
+            XCopyArea(w.display, w.overlay_pixmap, w.win, w.gc, 0, 0, overlayWidth, overlayHeight,
+                      w.win_width - overlayWidth - 4, w.win_height - overlayHeight - 4);
+        }
+
+        void renderFrame(AttachWindow &w)
+        {
+            Display *display = w.display;
+            auto frameStart = std::chrono::steady_clock::now();
+            int win_width = w.win_width;
+            int win_height = w.win_height;
+
+            XSetForeground(display, w.gc, BlackPixel(display, w.screen));
+            XFillRectangle(display, w.win, w.gc, 0, 0, win_width, win_height);
+
+            float x_scale = static_cast<float>(win_width) / w.banner_width;
+            float y_scale = static_cast<float>(win_height) / w.banner_height;
+            float scale = std::min(x_scale, y_scale);
+
+            int scaled_width = std::max(1, static_cast<int>(w.banner_width * scale));
+            int scaled_height = std::max(1, static_cast<int>(w.banner_height * scale));
+            w.scaled_width = scaled_width;
+            w.scaled_height = scaled_height;
+
+            auto scaleStart = std::chrono::steady_clock::now();
+            XImage *scaled_image = XCreateImage(display, DefaultVisual(display, w.screen), w.banner->depth, ZPixmap, 0, NULL, scaled_width, scaled_height, 32, 0);
+            scaled_image->data = (char *)malloc(scaled_image->bytes_per_line * scaled_height);
+
+            float x_ratio = (float)w.banner_width / (float)scaled_width;
+            float y_ratio = (float)w.banner_height / (float)scaled_height;
+
+            for (int y = 0; y < scaled_height; ++y)
+            {
+                for (int x = 0; x < scaled_width; ++x)
+                {
+                    int px = (int)(x * x_ratio);
+                    int py = (int)(y * y_ratio);
+                    XPutPixel(scaled_image, x, y, XGetPixel(w.banner, px, py));
+                }
+            }
+            w.stats.scale_us = elapsedMicros(scaleStart);
+
+            // The upload is only timed to the server when someone looks at the number.
+            bool measure = w.measure || logEnabled(LogLevel::Debug);
+            auto uploadStart = std::chrono::steady_clock::now();
+            XPutImage(display, w.win, w.gc, scaled_image, 0, 0, 0, 0, scaled_width, scaled_height);
+            if (measure)
+            {
+                XSync(display, False);
+            }
+            w.stats.upload_us = elapsedMicros(uploadStart);
+
+            free(scaled_image->data);
+            scaled_image->data = NULL;
+            XDestroyImage(scaled_image);
+
+            int line_height = 20;      // Height of each line in pixels
+            int x = scaled_width + 20; // X position where text starts
+            int y = 70;                // Initial Y position where text starts
+
+            XPutImage(display, w.win, w.gc, w.title, 0, 0, x, 0, w.title_width, w.title_height);
+
+            XSetForeground(display, w.gc, WhitePixel(display, w.screen)); // Set text color to white
+
+            // Draw the version and other info
+            std::string text = "version " + VERSION;
+            text += "\n\nPID: " + std::to_string(w.pid);
+            text += "\nErrors: " + lastQbusError;
+            text += "\n\nPress CTRL + D to close this window.";
+
+            std::istringstream iss(text);
+            std::string line;
+            while (std::getline(iss, line))
+            {
+                XDrawString(display, w.win, w.gc, x, y, line.c_str(), line.length());
+                y += line_height; // Move down for the next line
+            }
+
+            if (measure)
+            {
+                XSync(display, False); // Include the server's share of the frame in the measurement.
+            }
+            logMessage(LogLevel::Debug, "Frame %dx%d rendered in %lld us (scale %lld us, upload %lld us)",
+                       win_width, win_height, elapsedMicros(frameStart), w.stats.scale_us, w.stats.upload_us);
+
+            if (w.perf_overlay)
+            {
+                drawOverlay(w);
+            }
+        }
+        /// Events folded into one frame by the event loop.
+        struct EventBatch
+        {
+            unsigned long geometry_events = 0;
+            bool redraw = false;
+            bool quit = false;
+        };
+
+        bool isCloseKey(const AttachWindow &w, const XEvent &ev)
+        {
+            return ev.type == KeyPress && ev.xkey.keycode == XKeysymToKeycode(w.display, XK_d) && (ev.xkey.state & ControlMask);
+        }
+
+        void handleEvent(AttachWindow &w, const XEvent &ev, EventBatch &batch)
+        {
+            if (ev.type == ConfigureNotify)
+            {
+                batch.geometry_events++;
+                if (ev.xconfigure.width != w.win_width || ev.xconfigure.height != w.win_height)
+                {
+                    w.win_width = ev.xconfigure.width;
+                    w.win_height = ev.xconfigure.height;
+                    batch.redraw = true;
+                }
+            }
+            else if (ev.type == Expose)
+            {
+                batch.geometry_events++;
+                batch.redraw = true;
+            }
+            else if (ev.type == MapNotify || ev.type == UnmapNotify)
+            {
+                w.mapped = ev.type == MapNotify;
+            }
+            else if (ev.type == VisibilityNotify)
+            {
+                w.obscured = ev.xvisibility.state == VisibilityFullyObscured;
+            }
+            else if (isCloseKey(w, ev))
+            {
+                batch.quit = true;
+            }
+        }
+
+        /// Renders the frame for a batch, or counts it as skipped; returns whether a frame was rendered.
+        bool finishBatch(AttachWindow &w, const EventBatch &batch)
+        {
+            if (batch.redraw)
+            {
+                w.stats.events_coalesced += batch.geometry_events - 1;
+                renderFrame(w);
+                return true;
+            }
+            if (batch.geometry_events > 0)
+            {
+                // Only moves: the window contents are still valid.
+                w.stats.frames_skipped++;
+                if (w.perf_overlay)
+                {
+                    drawOverlay(w);
+                }
+            }
+            return false;
+        }
+
+        long long percentile(const std::vector<long long> &sorted, int percent)
+        {
+            if (sorted.empty())
+            {
+                return 0;
+            }
+            return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+        }
+
+        /**
+         * Feeds a recorded trace through the same batching and rendering as
+         * the live event loop, either with the recorded timing or batch by
+         * batch as fast as possible, and prints frame and CPU statistics.
+         * Frame latency is measured from the moment the first event of a
+         * batch is due until the frame has been processed by the server.
+         */
+        void replayTrace(AttachWindow &w, const EventTrace &trace, const std::string &path, bool fast)
+        {
+            Display *display = w.display;
+            w.win_width = trace.width;
+            w.win_height = trace.height;
+            XResizeWindow(display, w.win, w.win_width, w.win_height);
+            XSync(display, False);
+            int applied_width = w.win_width;
+            int applied_height = w.win_height;
+
+            std::vector<long long> latencies;
+            struct rusage usage_start;
+            getrusage(RUSAGE_SELF, &usage_start);
+            auto start = std::chrono::steady_clock::now();
+            auto due = start;
+            bool aborted = false;
+            size_t i = 0;
+            const size_t count = trace.events.size();
+
+            while (i < count && !aborted)
+            {
+                // The server's own events are results of our resizes; only CTRL+D matters.
+                XEvent ev;
+                while (XPending(display) > 0)
+                {
+                    XNextEvent(display, &ev);
+                    aborted = aborted || isCloseKey(w, ev);
+                }
+
+                due += std::chrono::microseconds(trace.events[i].delta_us);
+                if (!fast)
+                {
+                    std::this_thread::sleep_until(due);
+                }
+                auto batch_start = fast ? std::chrono::steady_clock::now() : due;
+
+                EventBatch batch;
+                while (true)
+                {
+                    const RecordedEvent &recorded = trace.events[i++];
+                    if (recorded.type != KeyPress && recorded.type != KeyRelease)
+                    {
+                        toXEvent(recorded, w.win, ev);
+                        handleEvent(w, ev, batch);
+                    }
+                    if (i >= count)
+                    {
+                        break;
+                    }
+                    if (fast ? (recorded.flags & RecordedEvent::EndOfBatch) != 0
+                             : due + std::chrono::microseconds(trace.events[i].delta_us) > std::chrono::steady_clock::now())
+                    {
+                        break;
+                    }
+                    if (!fast)
+                    {
+                        due += std::chrono::microseconds(trace.events[i].delta_us);
+                    }
+                }
+
+                if (batch.redraw && (w.win_width != applied_width || w.win_height != applied_height))
+                {
+                    XResizeWindow(display, w.win, w.win_width, w.win_height);
+                    applied_width = w.win_width;
+                    applied_height = w.win_height;
+                }
+                if (finishBatch(w, batch))
+                {
+                    latencies.push_back(elapsedMicros(batch_start));
+                }
+            }
+
+            auto wall_us = elapsedMicros(start);
+            struct rusage usage_end;
+            getrusage(RUSAGE_SELF, &usage_end);
+            long long user_us = cpuMicros(usage_start.ru_utime, usage_end.ru_utime);
+            long long system_us = cpuMicros(usage_start.ru_stime, usage_end.ru_stime);
+            std::sort(latencies.begin(), latencies.end());
+
+            printf("Replayed %zu of %zu events from %s (%s)%s\n", i, count, path.c_str(),
+                   fast ? "as fast as possible" : "original timing", aborted ? ", aborted" : "");
+            printf("Frames produced:   %zu\n", latencies.size());
+            printf("Frames skipped:    %lu\n", w.stats.frames_skipped);
+            printf("Events coalesced:  %lu\n", w.stats.events_coalesced);
+            printf("Frame latency:     min %lld us, median %lld us, p95 %lld us, max %lld us\n",
+                   latencies.empty() ? 0 : latencies.front(), percentile(latencies, 50), percentile(latencies, 95),
+                   latencies.empty() ? 0 : latencies.back());
+            printf("Wall time:         %lld ms\n", wall_us / 1000);
+            printf("CPU time:          %lld ms user, %lld ms system (%.1f%% of wall time)\n", user_us / 1000, system_us / 1000,
+                   wall_us > 0 ? 100.0 * (user_us + system_us) / wall_us : 0.0);
+        }
+
+        /// Prints the CPU time the animation used per second of playback.
+        void printAnimationBenchmark(const SteamAnimation &animation, std::chrono::steady_clock::time_point start, const struct rusage &usage_start)
+        {
+            auto wall_us = elapsedMicros(start);
+            struct rusage usage_end;
+            getrusage(RUSAGE_SELF, &usage_end);
+            long long user_us = cpuMicros(usage_start.ru_utime, usage_end.ru_utime);
+            long long system_us = cpuMicros(usage_start.ru_stime, usage_end.ru_stime);
+            double seconds = wall_us / 1e6;
+
+            printf("Animated for:      %.1f s\n", seconds);
+            printf("Frames presented:  %lu (%.1f per second)\n", animation.framesPresented(),
+                   seconds > 0 ? animation.framesPresented() / seconds : 0.0);
+            printf("Frame cache built: %lld ms\n", animation.buildMicros() / 1000);
+            printf("CPU time:          %lld ms user, %lld ms system\n", user_us / 1000, system_us / 1000);
+            printf("CPU per second:    %.2f ms (%.2f ms excluding frame cache builds)\n",
+                   seconds > 0 ? (user_us + system_us) / 1000.0 / seconds : 0.0,
+                   seconds > 0 ? std::max(0LL, user_us + system_us - animation.buildMicros()) / 1000.0 / seconds : 0.0);
+        }
+    } // namespace
+
+    void showUI(const UIOptions &options)
+    {
+        Display *display = XOpenDisplay(NULL);
+        if (display == NULL)
+        {
+            std::cerr << "Cannot open display" << std::endl;
+            if (options.replayPath.empty())
+            {
+                std::cerr << "Use 'caffeine8 attach --tui' to show the status in the terminal." << std::endl;
+            }
+            return;
+        }
+
+        int screen = DefaultScreen(display);
+        Window root = RootWindow(display, screen);
+        Window win = XCreateSimpleWindow(display, root, 10, 10, 900, 290, 1, BlackPixel(display, screen), BlackPixel(display, screen));
+
+        XStoreName(display, win, "caffeine8");
+        XSelectInput(display, win, ExposureMask | KeyPressMask | StructureNotifyMask | VisibilityChangeMask);
+        XMapWindow(display, win);
+
+        XEvent ev;
+        GC gc = XCreateGC(display, win, 0, NULL);
+
+        BannerAssets assets;
+        if (!loadBannerAssets(display, assets))
+        {
+            return;
+        }
+
+        AttachWindow w;
+        w.display = display;
+        w.screen = screen;
+        w.win = win;
+        w.gc = gc;
+        w.banner = assets.banner;
+        w.title = assets.title;
+        w.banner_width = assets.banner->width;
+        w.banner_height = assets.banner->height;
+        w.title_width = assets.title->width;
+        w.title_height = assets.title->height;
+        w.win_width = 900;
+        w.win_height = 290;
+        w.scaled_width = 0;
+        w.scaled_height = 0;
+        w.mapped = false;
+        w.obscured = false;
+        w.pid = getpid(); // Get the PID of the current process
+        w.perf_overlay = options.perfOverlay;
+        w.measure = options.perfOverlay || !options.replayPath.empty();
+        w.overlay_pixmap = None;
+        w.history_open = false;
+        if (w.perf_overlay)
+        {
+            w.overlay_pixmap = XCreatePixmap(display, win, overlayWidth, overlayHeight, DefaultDepth(display, screen));
+            w.history_open = w.history.openReadOnly(historyDirPath());
+        }
+
+        bool benchmark = options.animationBenchmarkSeconds > 0;
+        EventTrace trace;
+        if (!options.replayPath.empty())
+        {
+            if (!loadEventTrace(options.replayPath, trace))
+            {
+                std::cerr << "Cannot read event trace " << options.replayPath << std::endl;
+            }
+            else
+            {
+                replayTrace(w, trace, options.replayPath, options.replayFast);
+            }
+        }
+        else
+        {
+            EventRecorder recorder;
+            if (!options.recordPath.empty() && !recorder.open(options.recordPath, w.win_width, w.win_height))
+            {
+                std::cerr << "Cannot write event trace " << options.recordPath << std::endl;
+            }
+
+            // The steam only moves while keep-awake is active, which the
+            // daemon reports over its status subscription, and while the
+            // window can be seen.
+            SteamAnimation animation;
+            bool animate = (options.animate || benchmark) && animation.create(display, win, w.banner);
+            bool follow_daemon = animate && !benchmark;
+            StatusSubscription daemon;
+            DaemonStatus status;
+            if (follow_daemon)
+            {
+                daemon.start();
+            }
+
+            struct rusage usage_start;
+            getrusage(RUSAGE_SELF, &usage_start);
+            auto start = std::chrono::steady_clock::now();
+            auto benchmark_end = start + std::chrono::seconds(options.animationBenchmarkSeconds);
+
+            bool quit = false;
+            while (!quit)
+            {
+                bool was_running = animation.running();
+                if (animate && w.mapped && !w.obscured && ((daemon.known() && status.active) || benchmark))
+                {
+                    animation.start();
+                }
+                else if (was_running)
+                {
+                    animation.stop();
+                    if (w.mapped && !w.obscured)
+                    {
+                        renderFrame(w); // Put the still steam back.
+                    }
+                }
+
+                if (XPending(display) == 0)
+                {
+                    XFlush(display);
+                    auto now = std::chrono::steady_clock::now();
+                    long long timeout_ms = -1; // No deadline: wait for an event.
+                    if (benchmark)
+                    {
+                        timeout_ms = std::max(0LL, static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(benchmark_end - now).count()) + 1);
+                    }
+                    else if (follow_daemon)
+                    {
+                        timeout_ms = daemon.timeoutMs();
+                    }
+
+                    struct pollfd fds[3] = {{ConnectionNumber(display), POLLIN, 0},
+                                            {animation.running() ? animation.timerFd() : -1, POLLIN, 0},
+                                            {daemon.fd(), POLLIN, 0}};
+                    if (poll(fds, 3, static_cast<int>(timeout_ms)) < 0 && errno != EINTR)
+                    {
+                        logMessage(LogLevel::Error, "poll failed: %s", strerror(errno));
+                        break;
+                    }
+
+                    if (fds[1].revents & POLLIN)
+                    {
+                        animation.handleTimer();
+                    }
+                    if (follow_daemon)
+                    {
+                        daemon.update(status);
+                    }
+                    if (benchmark && std::chrono::steady_clock::now() >= benchmark_end)
+                    {
+                        break;
+                    }
+                    if (XPending(display) == 0)
+                    {
+                        continue;
+                    }
+                }
+
+                // Fold everything already queued into at most one frame: a resize
+                // drag produces a burst of ConfigureNotify and Expose events of
+                // which only the last geometry matters.
+                EventBatch batch;
+                XNextEvent(display, &ev);
+                while (true)
+                {
+                    recorder.record(ev);
+                    handleEvent(w, ev, batch);
+                    if (batch.quit || XPending(display) == 0)
+                    {
+                        break;
+                    }
+                    XNextEvent(display, &ev);
+                }
+                recorder.endBatch();
+
+                quit = batch.quit;
+                if (!quit && finishBatch(w, batch))
+                {
+                    // After a resize the steam stays static until the size
+                    // has held for a tick and the timer builds the frames.
+                    animation.setBannerSize(w.scaled_width, w.scaled_height);
+                    if (animation.running())
+                    {
+                        animation.present();
+                    }
+                }
+            }
+
+            if (benchmark)
+            {
+                printAnimationBenchmark(animation, start, usage_start);
+            }
+            animation.destroy();
+        }
+
+        if (w.overlay_pixmap != None)
+        {
+            XFreePixmap(display, w.overlay_pixmap);
+        }
+        freeBannerAssets(assets);
+        XFreeGC(display, gc);
+        XDestroyWindow(display, win);
+        XCloseDisplay(display);
+    }
+
+} // namespace caffeine8
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2023 Ulrich van Brakel
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Appends sessions with and without a suspend-sized gap between ticks and
+// checks the active time credited to the day totals. Built and run by
+// gap-test.sh.
+
+#include <cstdio>
+#include <string>
+#include "history.h"
+
+namespace
+{
+    const long tickIntervalMs = 60000;
+    const int64_t hour = 3600;
+
+    int64_t activeSeconds(const std::string &dir)
+    {
+        caffeine8::HistoryLog log;
+        if (!log.openReadOnly(dir))
+        {
+            return -1;
+        }
+        int64_t total = 0;
+        for (const caffeine8::DayTotal &day : log.dayTotalsSince(0))
+        {
+            total += day.activeSeconds;
+        }
+        return total;
+    }
+
+    bool check(const char *name, const std::string &dir, int64_t expected)
+    {
+        int64_t actual = activeSeconds(dir);
+        std::printf("gap-test: %s: %lld s active, expected %lld s\n", name, static_cast<long long>(actual), static_cast<long long>(expected));
+        return actual == expected;
+    }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        std::fprintf(stderr, "Usage: gap-test <work directory>\n");
+        return 2;
+    }
+    using caffeine8::HistoryEvent;
+    const int64_t t0 = 1700000000;
+    bool ok = true;
+
+    std::string steady = std::string(argv[1]) + "/steady";
+    {
+        caffeine8::HistoryLog log;
+        ok = log.openForAppend(steady, tickIntervalMs) &&
+             log.append(HistoryEvent::Start, t0) &&
+             log.append(HistoryEvent::Tick, t0 + 60) &&
+             log.append(HistoryEvent::Tick, t0 + 120) &&
+             log.append(HistoryEvent::Stop, t0 + 150);
+    }
+    ok = check("steady session", steady, 150) && ok;
+
+    // Suspended for eight hours after the second tick: only the time around
+    // the gap counts, not the gap itself.
+    std::string suspended = std::string(argv[1]) + "/suspended";
+    {
+        caffeine8::HistoryLog log;
+        ok = log.openForAppend(suspended, tickIntervalMs) &&
+             log.append(HistoryEvent::Start, t0) &&
+             log.append(HistoryEvent::Tick, t0 + 60) &&
+             log.append(HistoryEvent::Tick, t0 + 120) &&
+             log.append(HistoryEvent::Tick, t0 + 8 * hour) &&
+             log.append(HistoryEvent::Stop, t0 + 8 * hour + 30) && ok;
+    }
+    ok = check("gap after suspend", suspended, 150) && ok;
+
+    // The clock jumped ahead between the last tick and the Stop; the jump
+    // adds nothing.
+    std::string jumped = std::string(argv[1]) + "/jumped";
+    {
+        caffeine8::HistoryLog log;
+        ok = log.openForAppend(jumped, tickIntervalMs) &&
+             log.append(HistoryEvent::Start, t0) &&
+             log.append(HistoryEvent::Tick, t0 + 60) &&
+             log.append(HistoryEvent::Stop, t0 + 5 * hour) && ok;
+    }
+    ok = check("stop after clock jump", jumped, 60) && ok;
+
+    std::printf("gap-test: %s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
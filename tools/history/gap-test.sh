@@ -0,0 +1,21 @@
+#!/bin/sh
+# Checks that gaps between history records longer than the tick interval,
+# such as a suspend or a wall-clock jump, are not counted as active time.
+#
+# Usage: gap-test.sh <work directory>
+#
+# Builds tools/history/gap-test.cpp against src/history.cpp alone, which
+# needs no X11 or ImageMagick, and runs it on history files in the work
+# directory. CXX selects the compiler (default c++).
+
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(cd "$here/../.." && pwd)
+work=${1:?usage: gap-test.sh <work directory>}
+
+rm -rf "$work"
+mkdir -p "$work"
+
+"${CXX:-c++}" -std=c++17 -O1 -I"$root/include" "$here/gap-test.cpp" "$root/src/history.cpp" -o "$work/gap-test"
+"$work/gap-test" "$work"
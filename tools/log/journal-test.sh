@@ -0,0 +1,100 @@
+#!/bin/sh
+# Checks the journald native protocol output and the log rate limit.
+#
+# Usage: journal-test.sh <caffeine8 binary> <work directory>
+#
+# Binds a datagram socket in place of the journal, runs the daemon against
+# it with CAFFEINE8_LOG=journal:<socket> and a tick interval short enough
+# to exceed the rate limit, then checks that every datagram is a valid
+# PRIORITY/SYSLOG_IDENTIFIER/MESSAGE entry and that exactly 200 messages
+# were written, followed by one notice counting the suppressed rest. Uses
+# the PGO stub bus, its own PID file and state directory, so an instance
+# the user is running is not touched. Needs python3.
+
+set -eu
+
+bin=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+work=$2
+here=$(cd "$(dirname "$0")" && pwd)
+
+rm -rf "$work"
+mkdir -p "$work"
+work=$(cd "$work" && pwd)
+sock="$work/journal.sock"
+
+export PATH="$here/../pgo/stub-bus:$PATH"
+export XDG_STATE_HOME="$work/state"
+export CAFFEINE8_PID_FILE="$work/caffeine8.pid"
+export CAFFEINE8_LOG="journal:$sock"
+export CAFFEINE8_LOG_LEVEL=debug
+export CAFFEINE8_TICK_INTERVAL_MS=2
+
+# The listener exits once the socket has been quiet for a few seconds and
+# reports through its exit status.
+python3 - "$sock" <<'PYTHON' &
+import socket
+import sys
+
+sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+sock.bind(sys.argv[1])
+open(sys.argv[1] + ".ready", "w").close()
+sock.settimeout(3)
+datagrams = []
+try:
+    while True:
+        datagrams.append(sock.recv(65536))
+except socket.timeout:
+    pass
+
+failures = []
+messages = []
+for data in datagrams:
+    fields = {}
+    if not data.endswith(b"\n"):
+        failures.append("entry not newline terminated: %r" % data)
+        continue
+    for line in data[:-1].split(b"\n"):
+        name, sep, value = line.partition(b"=")
+        if not sep or not name.isupper():
+            failures.append("malformed field %r" % line)
+        fields[name] = value
+    if not fields.get(b"PRIORITY", b"").isdigit() or int(fields[b"PRIORITY"]) > 7:
+        failures.append("bad PRIORITY in %r" % data)
+    if fields.get(b"SYSLOG_IDENTIFIER") != b"caffeine8":
+        failures.append("bad SYSLOG_IDENTIFIER in %r" % data)
+    if b"MESSAGE" not in fields:
+        failures.append("no MESSAGE in %r" % data)
+    messages.append(fields.get(b"MESSAGE", b"").decode(errors="replace"))
+
+notices = [m for m in messages if m.endswith("log messages suppressed by rate limit")]
+if len(messages) != 201:
+    failures.append("expected 201 entries, got %d" % len(messages))
+if len(notices) != 1 or messages[-1] != notices[0] or int(notices[0].split()[0]) <= 0:
+    failures.append("expected one suppression notice at the end, got %r" % notices)
+
+for failure in failures[:20]:
+    print("journal-test: " + failure)
+if failures:
+    sys.exit(1)
+print("journal-test: %d entries, %s" % (len(messages), notices[0]))
+PYTHON
+listener=$!
+
+while [ ! -e "$sock.ready" ]; do
+    sleep 0.05
+done
+
+"$bin" start >/dev/null
+sleep 2
+pid=$(cat "$CAFFEINE8_PID_FILE")
+"$bin" stop >/dev/null
+while kill -0 "$pid" 2>/dev/null; do
+    sleep 0.05
+done
+
+if wait "$listener"; then
+    echo "journal-test: ok"
+else
+    echo "journal-test: FAILED" >&2
+    exit 1
+fi
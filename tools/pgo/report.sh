@@ -0,0 +1,40 @@
+#!/bin/sh
+# Compares a plain and a PGO/LTO caffeine8 binary on the training workload
+# and prints a Markdown report.
+#
+# Usage: report.sh <plain binary> <optimized binary> <work directory> [cycles]
+
+set -eu
+
+plain=$1
+optimized=$2
+work=$3
+cycles=${4:-20}
+here=$(cd "$(dirname "$0")" && pwd)
+
+mkdir -p "$work"
+sh "$here/train.sh" "$plain" "$work/plain" "$cycles" >"$work/plain.txt"
+sh "$here/train.sh" "$optimized" "$work/optimized" "$cycles" >"$work/optimized.txt"
+
+# Prints "<median> <p90> <samples>" for one metric, or "n/a n/a 0".
+stats() {
+    grep "^$1 " "$2" | cut -d' ' -f2 | sort -n | awk '
+        { v[NR] = $1 }
+        END {
+            if (NR == 0) { print "n/a n/a 0"; exit }
+            print v[int((NR + 1) / 2)], v[int((NR * 9 + 9) / 10)], NR
+        }'
+}
+
+echo "# caffeine8 PGO/LTO report"
+echo
+echo "Plain: \`$plain\` ($(wc -c <"$plain") bytes)"
+echo "PGO+LTO: \`$optimized\` ($(wc -c <"$optimized") bytes)"
+echo
+echo "| Metric | Plain median | Plain p90 | PGO+LTO median | PGO+LTO p90 | Median change | Samples |"
+echo "|---|---|---|---|---|---|---|"
+for metric in exec_to_ready_us tick_us frame_us; do
+    set -- $(stats "$metric" "$work/plain.txt") $(stats "$metric" "$work/optimized.txt")
+    change=$(awk -v a="$1" -v b="$4" 'BEGIN { if (a + 0 > 0 && b != "n/a") printf "%+.1f%%", (b - a) * 100 / a; else print "n/a" }')
+    echo "| $metric | $1 | $2 | $4 | $5 | $change | $3/$6 |"
+done
@@ -0,0 +1,121 @@
+#!/bin/sh
+# Representative caffeine8 workload, used both to train the PGO profile and
+# to measure binaries for tools/pgo/report.sh.
+#
+# Usage: train.sh <caffeine8 binary> <work directory> [cycles]
+#
+# Runs CLI start/history/stop cycles while the daemon ticks against a stub
+# bus, then resizes the attach window repeatedly on Xvfb when Xvfb and
+# xdotool are installed. Everything runs with its own PID file, state
+# directory and log, so an instance the user is running is not touched.
+# Prints one "<metric> <value>" line per sample:
+#   exec_to_ready_us  time from running 'caffeine8 start' until the daemon
+#                     logs its first tick, i.e. has opened its history, log
+#                     and control socket and made one keep-awake call
+#   tick_us           daemon time per tick, including the stub bus call
+#   frame_us          attach window time per rendered frame
+
+set -eu
+
+bin=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+work=$2
+cycles=${3:-20}
+here=$(cd "$(dirname "$0")" && pwd)
+
+rm -rf "$work"
+mkdir -p "$work"
+work=$(cd "$work" && pwd)
+
+export PATH="$here/stub-bus:$PATH"
+export XDG_STATE_HOME="$work/state"
+export CAFFEINE8_PID_FILE="$work/caffeine8.pid"
+log_file="$work/caffeine8.log"
+export CAFFEINE8_LOG="file:$log_file"
+export CAFFEINE8_LOG_LEVEL=debug
+export CAFFEINE8_TICK_INTERVAL_MS=20
+
+now_us() {
+    date +%s%6N
+}
+
+ticks_logged() {
+    n=$(grep -c 'Tick took' "$log_file" 2>/dev/null || true)
+    echo "${n:-0}"
+}
+
+# Waits for a tick beyond the given count; fails after ten seconds.
+wait_for_tick() {
+    deadline=$(($(now_us) + 10000000))
+    while [ "$(ticks_logged)" -le "$1" ]; do
+        if [ "$(now_us)" -gt "$deadline" ]; then
+            echo "train.sh: daemon did not log a tick" >&2
+            exit 1
+        fi
+    done
+}
+
+wait_for_exit() {
+    while [ -f "$CAFFEINE8_PID_FILE" ] && kill -0 "$(cat "$CAFFEINE8_PID_FILE")" 2>/dev/null; do
+        sleep 0.05
+    done
+}
+
+# CLI cycles; every fourth one runs against a failing bus to cover the error paths.
+i=0
+while [ "$i" -lt "$cycles" ]; do
+    if [ $((i % 4)) -eq 3 ]; then
+        export CAFFEINE8_STUB_BUS_ERROR=1
+    else
+        unset CAFFEINE8_STUB_BUS_ERROR
+    fi
+    before=$(ticks_logged)
+    t0=$(now_us)
+    "$bin" start >/dev/null
+    wait_for_tick "$before"
+    t1=$(now_us)
+    echo "exec_to_ready_us $((t1 - t0))"
+    sleep 0.5
+    "$bin" history --since 1d --summary >/dev/null
+    "$bin" history --since 1h >/dev/null
+    pid=$(cat "$CAFFEINE8_PID_FILE")
+    "$bin" stop >/dev/null
+    while kill -0 "$pid" 2>/dev/null; do
+        sleep 0.05
+    done
+    i=$((i + 1))
+done
+unset CAFFEINE8_STUB_BUS_ERROR
+
+# Attach window resize storm.
+if command -v Xvfb >/dev/null 2>&1 && command -v xdotool >/dev/null 2>&1; then
+    display=:$((90 + $$ % 100))
+    Xvfb "$display" -screen 0 1600x1200x24 -nolisten tcp >/dev/null 2>&1 &
+    xvfb=$!
+    trap 'kill "$xvfb" 2>/dev/null || true' EXIT
+    export DISPLAY="$display"
+    sleep 1
+
+    "$bin" start >/dev/null
+    "$bin" attach >/dev/null &
+    ui=$!
+    win=$(xdotool search --sync --name '^caffeine8$' | head -n 1)
+    round=0
+    while [ "$round" -lt "$cycles" ]; do
+        for size in "900 290" "1200 400" "640 200" "1500 900" "300 120" "1024 768"; do
+            # shellcheck disable=SC2086
+            xdotool windowsize "$win" $size
+        done
+        round=$((round + 1))
+    done
+    sleep 0.5
+    xdotool key --window "$win" ctrl+d
+    wait "$ui" || true
+    "$bin" stop >/dev/null
+    wait_for_exit
+else
+    echo "train.sh: Xvfb or xdotool not found, skipping the attach window workload" >&2
+fi
+
+sleep 0.2
+sed -n 's/.*Tick took \([0-9]*\) us.*/tick_us \1/p' "$log_file"
+sed -n 's/.*Frame [0-9]*x[0-9]* rendered in \([0-9]*\) us.*/frame_us \1/p' "$log_file"